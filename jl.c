@@ -1,11 +1,33 @@
+#define _POSIX_C_SOURCE 200809L
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <assert.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 typedef enum {
 	T_BEGINOBJECT,
@@ -26,16 +48,50 @@ typedef struct {
 	char *text;
 } Token;
 
+// The head of an item in a binary encoding: its kind and, depending on
+// the kind, its value, length or number of members.
+typedef struct {
+	enum {
+		V_UINT, V_NEGINT, V_INT, V_FLOAT, V_BOOL, V_NULL,
+		V_BYTES, V_TEXT, V_ARRAY, V_MAP, V_BREAK,
+	} kind;
+	uint64_t n;
+	int64_t i;
+	double d;
+	bool indefinite;
+} Head;
+
+// A producer of tokens for the matcher. Sources that know the size of a
+// value up front can skip it without producing its tokens.
+typedef struct {
+	void (*read_token)(void);
+	bool (*skip)(bool started);
+	bool (*read_head)(Head *h);
+} TokenSource;
+
+// A container being read from a binary source. Items counts keys and
+// values separately; fresh is set until the first item is read and after
+// once an item has been read but its separator has not been produced.
+typedef struct {
+	bool map, indefinite;
+	bool fresh, after;
+	uint64_t left, items;
+} Frame;
+
 typedef struct {
 	size_t len, cap;
 	char *str;
 } Buf;
 
+// names has the name of each column in JSON output
 typedef struct {
 	size_t nrows, ncols;
 	size_t rowcap;
 	Buf **rows;
 	Buf *newrow;
+	const char **names;
+	size_t field;
+	bool reject;
 } Table;
 
 typedef struct {
@@ -43,6 +99,11 @@ typedef struct {
 	Table *table;
 } Op;
 
+typedef struct {
+	Table **t;
+	size_t len, cap;
+} Tables;
+
 typedef struct {
 	Op op;
 	Op *next;
@@ -54,6 +115,7 @@ struct Prop {
 	char *name;
 	Op *op;
 	Prop *next;
+	Prop *alt;
 };
 
 typedef struct {
@@ -71,6 +133,95 @@ typedef struct {
 	char *pos;
 } Parser;
 
+// State of a UTF-8 sequence that continues past the end of a buffer: the
+// number of continuation bytes still needed, the range of the next one, and
+// the number of bytes of it read so far.
+typedef struct {
+	int need, have;
+	unsigned char lo, hi;
+} Utf8;
+
+// A merging t-digest: the first `merged` centroids are compressed and
+// sorted, the remainder are unmerged input values. The k1 scale function
+// keeps at most about TD_COMPRESSION centroids after compression.
+#define TD_COMPRESSION 200
+#define TD_SIZE (TD_COMPRESSION * 10)
+
+typedef struct {
+	double mean, weight;
+} Centroid;
+
+typedef struct {
+	Centroid c[TD_SIZE];
+	size_t merged, len;
+	double total, min, max;
+} TDigest;
+
+// Bump allocator for data that lives until the arena is freed.
+typedef struct Block Block;
+struct Block {
+	Block *next;
+	size_t len, cap;
+	char data[];
+};
+
+typedef struct {
+	Block *head;
+	size_t size;
+} Arena;
+
+// An output line and the position of the key field within it.
+typedef struct {
+	char *str;
+	size_t len;
+	size_t keyoff, keylen;
+} Row;
+
+typedef struct {
+	double key;
+	Buf line;
+} TopEntry;
+
+typedef struct {
+	Row row;
+	double num;
+	bool isnum;
+	size_t seq;
+} SortEntry;
+
+// A sorted sequence of rows being merged: either a slice of the run in
+// memory or a run that was spilled to a file.
+typedef struct {
+	SortEntry cur;
+	SortEntry *next, *end;
+	FILE *f;
+	Buf buf;
+	size_t index;
+} MergeSource;
+
+typedef struct {
+	uint64_t hash;
+	char *str;
+	size_t len;
+} SetEntry;
+
+// Open-addressing hash set of strings stored in an arena.
+typedef struct {
+	SetEntry *e;
+	size_t len, cap;
+	Arena arena;
+} StrSet;
+
+// Rows that do not fit in the set are spilled to partitions, which are
+// deduplicated one at a time once the input ends.
+#define NPARTS 16
+
+typedef struct {
+	StrSet set;
+	FILE *part[NPARTS];
+	int depth;
+} Distinct;
+
 static ArrayOp *new_array_op(void);
 static ObjectOp *new_object_op(void);
 static CollectOp *new_collect_op(Table *t);
@@ -79,39 +230,164 @@ static Op *parse_pattern(char *pat);
 static ArrayOp *parse_array(Parser *p);
 static ObjectOp *parse_object(Parser *p);
 static Prop *parse_property(Parser *p, ObjectOp *obj);
+static char *parse_name(Parser *p);
 static Prop *add_property(ObjectOp *op, char *name);
 
 static Table *new_table(void);
-static void add_value(Table *t, size_t column, char *val);
+static void add_value(Table *t, size_t column, char *val, bool str);
+static void name_columns(Op *op, const char *name);
 static void add_row(Table *t);
 
 static bool find_root(Op *head);
 
+static void run_input(Op *head);
+static void reset_input(void);
+static void reset_tables(void);
+static bool sample_record(void);
+static void sample_finish(void);
+static void grep_record(void);
+static char *capture_record(size_t *len);
+static void capture_next(void);
+static void capture_save(void);
+static void capture_restore(void);
+static void patch_buf(char *p);
+static void route_scan(void);
+static void route_record(void);
+static bool route_needs(const char *name);
+static double random_double(void);
+static void put_row(Buf *b, Row *r);
+
 static void flush_tables(void);
 static void emit_row(size_t *rowindex);
+static void write_table_row(Table *t, Buf *row, FILE *f);
+static void join_load(void);
+static void join_add(Buf *key, Buf *val, size_t ncols);
+static bool join_row(size_t off, size_t len);
+static bool add_identity(Buf *b, const char *path);
+static void output_row(Row *r);
+static void deliver_row(Row *r);
+static void write_row(Row *r);
+static void write_out(const char *s, size_t len);
+static void out_start(void);
+static void out_flush(void);
+static void splice_out(const char *s, size_t len);
+static bool splice_buf(void);
+static void work_run(Op *head);
+static void work_input(Op *head);
+static void add_input(char *path);
+static void read_list(const char *path);
+static int cmp_name(const void *a, const void *b);
+static void run_file(Op *head, char *path);
+static void work_flush(void);
+static void spill_row(FILE *f, Row *r);
+static bool unspill_row(FILE *f, Buf *b, Row *r);
+static bool parse_number(const char *s, size_t len, double *v);
+
+static bool top_accepts(double key);
+static void top_row(Row *r);
+static void top_finish(void);
+static void top_siftdown(size_t i);
+static int cmp_top(const void *a, const void *b);
+
+static void sort_row(Row *r);
+static void spill_run(void);
+static void sort_run(FILE *out);
+static void merge_runs(FILE *out);
+static void *sort_slice(void *arg);
+static void sort_finish(void);
+static void merge(MergeSource *src, size_t n, FILE *out);
+static bool merge_advance(MergeSource *m);
+static void merge_siftdown(MergeSource **heap, size_t n, size_t i);
+static int cmp_sort(const void *a, const void *b);
+static int cmp_source(const MergeSource *a, const MergeSource *b);
+
+static void distinct_row(Distinct *d, Row *r, uint64_t hash);
+static void distinct_finish(Distinct *d);
+static bool set_insert(StrSet *s, char *str, size_t len, uint64_t hash);
+static SetEntry *set_add(StrSet *s, char *str, size_t len, uint64_t hash, size_t extra);
+static SetEntry *set_find(StrSet *s, char *str, size_t len, uint64_t hash);
+static size_t set_size(StrSet *s);
+static void set_free(StrSet *s);
+static uint64_t hash_bytes(const char *s, size_t len);
+
+static void *arena_alloc(Arena *a, size_t size);
+static void arena_free(Arena *a);
+
+static void td_add(TDigest *td, double mean, double weight);
+static void td_compress(TDigest *td);
+static double td_limit(double q);
+static double td_quantile(TDigest *td, double q);
+static void td_merge(TDigest *td, TDigest *from);
+static int cmp_centroid(const void *a, const void *b);
+static void print_quantiles(void);
+
+static bool cache_key(int files, Buf *b);
+static bool cache_open(int files);
+static bool cache_match(FILE *f);
+static void cache_finish(int files);
+static void cache_discard(void);
 
 static Token *next_token(void);
 static Token *peek_token(void);
+static Token *next_key(void);
 
 static void read_token(void);
 static void read_literal(Token *t, char *v, size_t offset);
 static void after_quote(void);
+static size_t string_run(void);
+static void skip_space(void);
+static size_t space_run(void);
 static void after_slash(void);
+static void decode_escape(int c);
+static long read_hex4(void);
+static void text_utf8(long cp);
+static void read_number(int c);
+static void text_trim(void);
+static size_t number_run(int c);
+static void number_fail(const char *p, const char *msg);
 static void after_minus(void);
 static void after_0(void);
 static void after_1to9(void);
 static void after_frac(void);
 static void after_exp(void);
 static int append_digits(void);
+static void bin_read_token(void);
+static bool bin_skip(bool started);
+static void bin_push(bool map, Head *h);
+static void bin_item_done(void);
+static bool bin_frame_done(Frame *f);
+static void bin_skip_item(Head *h);
+static void bin_text(Head *h);
+static void bin_number(Head *h);
+static bool cbor_head(Head *h);
+static bool msgpack_head(Head *h);
+static uint64_t read_be(int n);
+static int read_byte(void);
+static int peek_byte(void);
+static void skip_bytes(uint64_t n);
+static void text_escaped(const char *s, size_t len);
+static void append_escaped(Buf *b, const char *s, size_t len);
+static void append_name(Buf *b, const char *s);
+static void text_hex(const char *s, size_t len);
+
 static int read_char(void);
+static bool fill_buf(void);
+static size_t check_utf8(const unsigned char *s, size_t len, Utf8 *u);
 static void unread_char(int c);
 
+static void text_char(char c);
+static void text_str(const char *s, size_t len);
+static size_t parse_size(const char *s);
+
 static void append_char(Buf *b, char c);
+static void append_str(Buf *b, const char *s, size_t len);
 static void ensure_bufcap(Buf *b, size_t c);
 
 static void run_op(Op *op);
 static void run_array_op(ArrayOp *op);
 static void run_object_op(ObjectOp *op);
+static void run_members(ObjectOp *op, Token *t);
+static Prop *find_prop(ObjectOp *op, const char *name);
 static void run_collect_op(CollectOp *op);
 
 static void accept(TokenType type);
@@ -120,73 +396,641 @@ static void skip_array(void);
 static void skip_object(void);
 static bool is_literal(TokenType type);
 
+static void fail(const char *fmt, ...);
+static void fail_at(uint64_t off);
+static void utf8_fail(size_t i, const char *msg);
 static void die(const char *fmt, ...);
 static void *xcalloc(size_t nmemb, size_t size);
 static void *xrealloc(void *ptr, size_t size);
+static void xfree(void *ptr);
+static void mem_charge(size_t size);
+
+static char inbuf[BUFSIZ];
 
-struct {
+struct lexer {
 	FILE *file;
 
+	char *name;
+
+	// bytes up to lim have been validated; lim < len when the byte at lim
+	// is not valid UTF-8
 	struct {
-		char data[BUFSIZ];
-		size_t i, len;
+		char *data;
+		size_t i, lim, len;
+		uint64_t pos;
 	} buf;
 	int unread;
 
+	// the pages of large files are dropped from the page cache up to
+	// dropped as they are read
+	bool dropping;
+	uint64_t dropped;
+
+	bool eof, eol;
+	Utf8 utf8;
+
+	// room is what is left of the maximum value size for the token; the
+	// size of property names, read when key is set, is not limited
 	Buf text;
+	size_t room;
+	bool key;
 	Token token, *peek;
+
+	const TokenSource *source;
+	struct {
+		Frame *f;
+		size_t len, cap;
+	} frames;
+
+	// the input is read from start, and ends before the first record at
+	// or after end when end is set
+	uint64_t start, end;
+
+	// without a file the input is the memlen bytes at mem
+	char *mem;
+	size_t memlen;
+
+	// input errors jump here when set
+	jmp_buf *recover;
+	uint64_t recstart;
+	char error[256];
+	uint64_t erroff;
 } lexer;
 
+static Tables tables;
+
+// Character classes for the lexer
+enum {
+	C_SPACE = 1,
+	C_DIGIT = 2,
+	C_NUMBER = 4,
+};
+
+static const unsigned char chars[256] = {
+	[' '] = C_SPACE, ['\t'] = C_SPACE, ['\n'] = C_SPACE, ['\r'] = C_SPACE,
+	['0'] = C_DIGIT | C_NUMBER, ['1'] = C_DIGIT | C_NUMBER,
+	['2'] = C_DIGIT | C_NUMBER, ['3'] = C_DIGIT | C_NUMBER,
+	['4'] = C_DIGIT | C_NUMBER, ['5'] = C_DIGIT | C_NUMBER,
+	['6'] = C_DIGIT | C_NUMBER, ['7'] = C_DIGIT | C_NUMBER,
+	['8'] = C_DIGIT | C_NUMBER, ['9'] = C_DIGIT | C_NUMBER,
+	['-'] = C_NUMBER, ['+'] = C_NUMBER, ['.'] = C_NUMBER,
+	['e'] = C_NUMBER, ['E'] = C_NUMBER,
+};
+
+static const TokenSource json_source = { read_token, NULL, NULL };
+static const TokenSource cbor_source = { bin_read_token, bin_skip, cbor_head };
+static const TokenSource msgpack_source = { bin_read_token, bin_skip, msgpack_head };
+
+static TDigest digest;
+static Distinct distinct;
+static Buf line;
+
 static struct {
-	Table **t;
+	enum { S_NONE, S_EVERY, S_BERNOULLI, S_RESERVOIR, S_HASH } mode;
+	double p;
+	size_t n, seen;
+	uint64_t random;
+	Buf *slots, *slot;
+} sample;
+
+static struct {
+	TopEntry *e;
+	size_t len;
+} top;
+
+// With --join, rows get the fields of the line of the lookup file whose
+// first field is their key field; each line is stored after its key in
+// set, as its number of fields followed by the fields separated by
+// fieldsep. Rows are padded to ncols fields, and rows without a line are
+// dropped with --inner-join. The key is field, or the key field if 0.
+static struct {
+	const char *path;
+	size_t field;
+	bool inner;
+	StrSet set;
+	size_t ncols;
+} join;
+
+// With --normalize, the rows of each table are written once to their own
+// file instead of being joined, after the number of their record
+static struct {
+	const char *prefix;
+	FILE **files;
+	uint64_t record;
+} norm;
+
+// The raw text of the current record is captured when on. The record
+// starts at from in the buffer, after the part in raw that was read before
+// the last refill. Strings used in place are terminated in the buffer;
+// patches has what they replaced.
+static struct {
+	bool on;
+	Buf raw;
+	size_t from;
+	struct {
+		size_t off;
+		char c;
+	} *patches;
+	size_t npatches, cap;
+} capture;
+
+// With --grep, each record that has a row whose key field is value is
+// written out as it was read
+static struct {
+	const char *value;
+	bool matched;
+} grep;
+
+// With --route, each record is matched with the pattern of the route whose
+// value is that of its top-level member name: first it is scanned for the
+// member, then its captured text is matched again, with tables, in place
+typedef struct {
+	const char *value;
+	char *pattern;
+	Op *head;
+	Tables tables;
+} Route;
+
+static struct {
+	const char *name;
+	Route *r;
+	size_t len, cap;
+	Route *match, *cur;
+} route;
+
+// With --splice, output to a pipe is handed to the kernel by reference,
+// from a ring of nbufs buffers of OUTSIZE bytes. A buffer is only reused
+// after more than the capacity of the pipe has been written since, when
+// it has been read.
+#define OUTSIZE ((size_t)64 << 10)
+
+static struct {
+	char *ring;
+	size_t nbufs, cur, len;
+	bool splicing;
+} out;
+
+// With --unordered, the input files are chunks that worker processes take
+// in turn from next in shared until all have been read; NDJSON files are
+// split into chunks of CHUNKSIZE bytes, and end is 0 for a whole file.
+// Each worker keeps its output in buf and writes it out under lock, in
+// blocks of whole records, when it reaches OUTSIZE, and adds its values for
+// --quantiles to digest when done.
+#define CHUNKSIZE ((uint64_t)1 << 20)
+
+static struct {
+	bool on;
+	struct {
+		size_t file;
+		uint64_t start, end;
+	} *chunks;
+	size_t nchunks;
+	struct {
+		pthread_mutex_t lock;
+		size_t next;
+		size_t nbad;
+		TDigest digest;
+	} *shared;
+	Buf buf;
+} work;
+
+// The files to read: the FILE arguments, then the paths in the --files-from
+// list, with directories replaced by the files under them in name order.
+// Files of up to SMALLSIZE bytes are read whole into small.
+#define SMALLSIZE ((off_t)64 << 10)
+
+static struct {
+	char **path;
 	size_t len, cap;
-} tables;
+	const char *list;
+	Buf small;
+} inputs;
+
+// Output is also written to file, which is renamed to path when complete.
+// argv is a copy of the arguments taken before parsing writes into them, opt
+// is the index of the --cache option, left out of the key, and text is the
+// key in full, stored at the start of the file and compared on a hit.
+static struct {
+	char *dir;
+	char **argv;
+	int opt;
+	uint64_t key;
+	Buf text;
+	char *path, *tmp;
+	FILE *file;
+} cache;
+
+// Rows are buffered in a run until it reaches the memory budget, at which
+// point the run is sorted and spilled.
+#define MAXRUNS 64
+
+// Memory from xcalloc and xrealloc is counted in used, after a header that
+// holds the size of each block. With --max-memory, allocations that would
+// take it past max are fatal, and sorting and --distinct spill at a quarter
+// of max.
+typedef union {
+	size_t size;
+	long double ld;
+	intmax_t i;
+	void *p;
+} MemHeader;
 
-const char usage[] = "usage: jl [-f FIELDSEP] PATTERN [FILE...]\n";
+static struct {
+	size_t used, max;
+} mem;
+
+// Input files of at least DROPSIZE bytes are not kept in the page cache;
+// the pages behind the cursor are dropped every DROPSTEP bytes
+#define DROPSIZE ((off_t)1 << 30)
+#define DROPSTEP ((uint64_t)8 << 20)
+
+static struct {
+	SortEntry *e;
+	size_t len, cap, seq;
+	Arena arena;
+	FILE *runs[MAXRUNS + 1];
+	size_t nruns;
+} sorter;
+
+const char usage[] = "usage: jl [OPTION...] PATTERN [FILE...]\n";
 const char *fieldsep = "\t";
+size_t keyfield = 1;
+size_t membudget = (size_t)256 << 20;
+size_t topn;
+size_t nthreads;
+bool quantiles;
+bool unique;
+bool sorting;
+bool ndjson;
+bool validating;
+bool checkutf8;
+bool decoding;
+bool trusted;
+bool splicing;
+bool unordered;
+bool jsonout;
+size_t maxvalue = SIZE_MAX;
+bool invalid;
+FILE *badfile;
+size_t nbad;
 
 int main(int argc, char *argv[])
 {
-	if (argc < 2)
-		die(usage);
-
 	int argi = 1;
 
-	if (!strcmp(argv[argi], "-f")) {
-		if (argi + 2 >= argc)
+	cache.argv = xcalloc(argc + 1, sizeof(char *));
+	for (int i = 0; i < argc; i++) {
+		size_t len = strlen(argv[i]) + 1;
+		cache.argv[i] = memcpy(xcalloc(len, 1), argv[i], len);
+	}
+
+	for (; argi < argc && argv[argi][0] == '-'; argi++) {
+		char *opt = argv[argi];
+
+		if (!strcmp(opt, "--")) {
+			argi++;
+			break;
+		}
+		else if (!strcmp(opt, "--quantiles")) {
+			quantiles = true;
+			continue;
+		}
+		else if (!strcmp(opt, "--distinct")) {
+			unique = true;
+			continue;
+		}
+		else if (!strcmp(opt, "--sort")) {
+			sorting = true;
+			continue;
+		}
+		else if (!strcmp(opt, "--ndjson")) {
+			ndjson = true;
+			continue;
+		}
+		else if (!strcmp(opt, "--validate")) {
+			validating = checkutf8 = true;
+			continue;
+		}
+		else if (!strcmp(opt, "--utf8")) {
+			checkutf8 = true;
+			continue;
+		}
+		else if (!strcmp(opt, "--decode")) {
+			decoding = true;
+			continue;
+		}
+		else if (!strcmp(opt, "--trusted")) {
+			trusted = true;
+			continue;
+		}
+		else if (!strcmp(opt, "--json")) {
+			jsonout = true;
+			continue;
+		}
+		else if (!strcmp(opt, "--inner-join")) {
+			join.inner = true;
+			continue;
+		}
+		else if (!strcmp(opt, "--splice")) {
+			splicing = true;
+			continue;
+		}
+		else if (!strcmp(opt, "--unordered")) {
+			unordered = true;
+			continue;
+		}
+		else if (!strcmp(opt, "--cbor")) {
+			lexer.source = &cbor_source;
+			continue;
+		}
+		else if (!strcmp(opt, "--msgpack")) {
+			lexer.source = &msgpack_source;
+			continue;
+		}
+
+		// the remaining options take an argument
+		if (argi + 1 >= argc)
+			die(usage);
+
+		char *arg = argv[++argi];
+
+		if (!strcmp(opt, "-f")) {
+			fieldsep = arg;
+		}
+		else if (!strcmp(opt, "--top")) {
+			char *end;
+			topn = strtoul(arg, &end, 10);
+			if (topn == 0 || *end != '\0')
+				die("invalid number of rows: %s\n", arg);
+			top.e = xcalloc(topn, sizeof(*top.e));
+		}
+		else if (!strcmp(opt, "--sample")) {
+			static const char *modes[] = {
+				[S_EVERY] = "every:",
+				[S_BERNOULLI] = "bernoulli:",
+				[S_RESERVOIR] = "reservoir:",
+				[S_HASH] = "hash:",
+			};
+
+			char *val = NULL, *end;
+			for (size_t m = S_EVERY; m <= S_HASH; m++) {
+				if (!strncmp(arg, modes[m], strlen(modes[m]))) {
+					sample.mode = m;
+					val = arg + strlen(modes[m]);
+				}
+			}
+
+			if (!val)
+				die("invalid sample mode: %s\n", arg);
+
+			if (sample.mode == S_BERNOULLI || sample.mode == S_HASH) {
+				sample.p = strtod(val, &end);
+				if (end == val || *end != '\0' || sample.p < 0 || sample.p > 1)
+					die("invalid sample probability: %s\n", val);
+			}
+			else {
+				sample.n = strtoul(val, &end, 10);
+				if (sample.n == 0 || end == val || *end != '\0')
+					die("invalid sample size: %s\n", val);
+			}
+
+			if (sample.mode == S_RESERVOIR)
+				sample.slots = xcalloc(sample.n, sizeof(*sample.slots));
+
+			sample.random = (uint64_t)time(NULL) << 20 ^ (uint64_t)getpid();
+		}
+		else if (!strcmp(opt, "--join")) {
+			join.path = arg;
+		}
+		else if (!strcmp(opt, "--normalize")) {
+			norm.prefix = arg;
+		}
+		else if (!strcmp(opt, "--route")) {
+			route.name = arg;
+		}
+		else if (!strcmp(opt, "--when")) {
+			char *eq = strchr(arg, '=');
+			if (!eq)
+				die("invalid route: %s\n", arg);
+			*eq = '\0';
+
+			if (route.len == route.cap) {
+				route.cap = route.cap == 0 ? 4 : route.cap * 2;
+				route.r = xrealloc(route.r, route.cap * sizeof(*route.r));
+			}
+			route.r[route.len++] = (Route){ .value = arg, .pattern = eq + 1 };
+		}
+		else if (!strcmp(opt, "--files-from")) {
+			inputs.list = arg;
+		}
+		else if (!strcmp(opt, "--grep")) {
+			grep.value = arg;
+		}
+		else if (!strcmp(opt, "--cache")) {
+			cache.dir = arg;
+			cache.opt = argi - 1;
+		}
+		else if (!strcmp(opt, "--bad-offsets")) {
+			badfile = fopen(arg, "w");
+			if (!badfile)
+				die("%s: %s\n", arg, strerror(errno));
+		}
+		else if (!strcmp(opt, "--max-value-bytes")) {
+			maxvalue = parse_size(arg);
+		}
+		else if (!strcmp(opt, "--max-memory")) {
+			mem.max = parse_size(arg);
+			if (mem.max / 4 < membudget)
+				membudget = mem.max / 4;
+		}
+		else if (!strcmp(opt, "--threads")) {
+			char *end;
+			nthreads = strtoul(arg, &end, 10);
+			if (nthreads == 0 || *end != '\0')
+				die("invalid number of threads: %s\n", arg);
+		}
+		else if (!strcmp(opt, "--join-key")) {
+			char *end;
+			join.field = strtoul(arg, &end, 10);
+			if (join.field == 0 || *end != '\0')
+				die("invalid key field: %s\n", arg);
+		}
+		else if (!strcmp(opt, "-k")) {
+			char *end;
+			keyfield = strtoul(arg, &end, 10);
+			if (keyfield == 0 || *end != '\0')
+				die("invalid key field: %s\n", arg);
+		}
+		else {
+			die(usage);
+		}
+	}
+
+	if (nthreads == 0) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = n > 0 ? n : 1;
+	}
+
+	if (!lexer.source)
+		lexer.source = &json_source;
+	else if (ndjson || checkutf8)
+		die("binary input cannot be combined with --ndjson, --utf8 or --validate\n");
+
+	if (trusted && validating)
+		die("--trusted cannot be combined with --validate\n");
+
+	if (grep.value && (quantiles || unique || topn || sorting || validating ||
+			sample.mode == S_RESERVOIR || lexer.source != &json_source))
+		die("--grep cannot be combined with --quantiles, --distinct, --top, "
+				"--sort, --validate, reservoir sampling or binary input\n");
+
+	if (unordered && (unique || topn || sorting || validating ||
+			norm.prefix || cache.dir || splicing || badfile ||
+			(sample.mode != S_NONE && sample.mode != S_HASH)))
+		die("--unordered cannot be combined with --distinct, --top, --sort, "
+				"--validate, --normalize, --cache, --splice, --bad-offsets or "
+				"sampling other than hash\n");
+
+	if (!route.name != !route.len)
+		die("--route and --when are used together\n");
+
+	if (route.len > 0) {
+		if (quantiles || unique || topn || sorting || grep.value || validating ||
+				norm.prefix || join.path || sample.mode == S_HASH ||
+				sample.mode == S_RESERVOIR || lexer.source != &json_source)
+			die("--route cannot be combined with --quantiles, --distinct, --top, "
+					"--sort, --grep, --validate, --normalize, --join, row sampling "
+					"or binary input\n");
+
+		// each route has tables of its own
+		for (size_t i = 0; i < route.len; i++) {
+			Route *r = &route.r[i];
+
+			tables = (Tables){ 0 };
+			r->head = parse_pattern(r->pattern);
+			if (!r->head)
+				die("invalid pattern: %s\n", r->pattern);
+			if (!find_root(r->head))
+				abort();
+			r->tables = tables;
+		}
+	}
+
+	capture.on = grep.value || route.len > 0;
+
+	// validation only skips over the values and needs no pattern, and
+	// routes have their own
+	Op *head = NULL;
+
+	if (!validating && route.len == 0) {
+		if (argi >= argc)
 			die(usage);
 
-		fieldsep = argv[argi + 1];
-		argi += 2;
+		head = parse_pattern(argv[argi++]);
+
+		if (head == NULL)
+			die("invalid pattern\n");
+
+		Table *last = tables.t[tables.len - 1];
+		if (keyfield >= last->field + last->ncols)
+			die("key field out of range: %zu\n", keyfield);
+
+		if (join.field == 0)
+			join.field = keyfield;
+		else if (join.field >= last->field + last->ncols)
+			die("key field out of range: %zu\n", join.field);
+
+		if (!find_root(head))
+			abort();
+	}
+
+	if (join.path) {
+		if (jsonout || norm.prefix || validating)
+			die("--join cannot be combined with --json, --normalize or --validate\n");
+
+		join_load();
 	}
 
-	Op *head = parse_pattern(argv[argi++]);
+	if (norm.prefix) {
+		if (quantiles || unique || topn || sorting || grep.value || validating ||
+				sample.mode == S_HASH || sample.mode == S_RESERVOIR)
+			die("--normalize cannot be combined with --quantiles, --distinct, "
+					"--top, --sort, --grep, --validate or row sampling\n");
 
-	if (head == NULL)
-		die("invalid pattern\n");
+		norm.files = xcalloc(tables.len, sizeof(*norm.files));
 
-	if (!find_root(head))
-		abort();
+		for (size_t i = 0; i < tables.len; i++) {
+			size_t len = strlen(norm.prefix) + 24;
+			char *path = xcalloc(len, 1);
+			snprintf(path, len, "%s%zu", norm.prefix, i + 1);
+
+			norm.files[i] = fopen(path, "w");
+			if (!norm.files[i])
+				die("%s: %s\n", path, strerror(errno));
+			xfree(path);
+		}
+	}
+
+	int files = argi;
+	bool usestdin = argi == argc && !inputs.list;
+
+	for (; argi < argc; argi++)
+		add_input(argv[argi]);
 
-	Token *t;
+	if (inputs.list)
+		read_list(inputs.list);
 
-	if (argi == argc) {
+	if (cache.dir && cache_open(files))
+		return 0;
+
+	out_start();
+
+	if (unordered && usestdin)
+		die("--unordered needs input files\n");
+
+	if (usestdin) {
 		lexer.file = stdin;
-		do {
-			run_op(head);
-			t = peek_token();
-		} while (t->type != T_EOF);
+		lexer.name = "(standard input)";
+		run_input(head);
+	}
+	else if (unordered) {
+		work_run(head);
 	}
 	else {
-		for (; argi < argc; argi++) {
-			lexer.file = fopen(argv[argi], "r");
-			do {
-				run_op(head);
-				t = peek_token();
-			} while (t->type != T_EOF);
-			fclose(lexer.file);
-		}
+		for (size_t i = 0; i < inputs.len; i++)
+			run_file(head, inputs.path[i]);
+	}
+
+	if (sample.mode == S_RESERVOIR)
+		sample_finish();
+
+	if (unique)
+		distinct_finish(&distinct);
+
+	if (topn)
+		top_finish();
+
+	if (sorting)
+		sort_finish();
+
+	if (quantiles)
+		print_quantiles();
+
+	if (badfile && fclose(badfile))
+		die("close: %s\n", strerror(errno));
+
+	for (size_t i = 0; norm.prefix && i < tables.len; i++) {
+		if (fclose(norm.files[i]))
+			die("close: %s\n", strerror(errno));
 	}
+
+	if (nbad > 0 && !validating)
+		fprintf(stderr, "jl: skipped %zu malformed records\n", nbad);
+
+	if (cache.file)
+		cache_finish(files);
+
+	return invalid;
 }
 
 Op *parse_pattern(char *pat)
@@ -199,17 +1043,59 @@ Op *parse_pattern(char *pat)
 	else if (*p.pos == '{')
 		op = (Op*)parse_object(&p);
 
-	// initialize tables
+	// initialize tables and number the output fields
 	if (op) {
+		size_t field = 1;
 		for (size_t i = 0; i < tables.len; i++) {
 			Table *t = tables.t[i];
 			t->newrow = xcalloc(t->ncols, sizeof(*t->newrow));
+			t->names = xcalloc(t->ncols, sizeof(*t->names));
+			t->field = field;
+			field += t->ncols;
 		}
+
+		name_columns(op, NULL);
 	}
 
 	return op;
 }
 
+void name_columns(Op *op, const char *name)
+{
+	// a column is named after the path of properties it is in, joined by
+	// dots so that names are unique, or else its field number
+	switch (op->type) {
+	case OP_OBJECT:
+		for (Prop *p = ((ObjectOp*)op)->prop; p; p = p->next) {
+			if (!name) {
+				name_columns(p->op, p->name);
+				continue;
+			}
+
+			size_t len = strlen(name) + strlen(p->name) + 2;
+			char *path = xcalloc(len, 1);
+			snprintf(path, len, "%s.%s", name, p->name);
+			name_columns(p->op, path);
+		}
+		break;
+	case OP_ARRAY:
+		name_columns(((ArrayOp*)op)->next, name);
+		break;
+	case OP_COLLECT: {
+		Table *t = op->table;
+		size_t column = ((CollectOp*)op)->column;
+
+		if (!name) {
+			char *num = xcalloc(24, 1);
+			snprintf(num, 24, "%zu", t->field + column);
+			name = num;
+		}
+		t->names[column] = name;
+		break;
+	}
+	}
+}
+
 ArrayOp *parse_array(Parser *p)
 {
 	if (*p->pos++ != '[')
@@ -304,6 +1190,29 @@ ObjectOp *parse_object(Parser *p)
 }
 
 Prop *parse_property(Parser *p, ObjectOp *obj)
+{
+	char *name = parse_name(p);
+
+	if (!name)
+		return NULL;
+
+	Prop *prop = add_property(obj, name);
+
+	// alternative names separated by | share the property's op
+	for (Prop *a = prop; *p->pos == '|'; a = a->alt) {
+		*p->pos++ = '\0';
+
+		if (!(name = parse_name(p)))
+			return NULL;
+
+		a->alt = xcalloc(1, sizeof(*a->alt));
+		a->alt->name = name;
+	}
+
+	return prop;
+}
+
+char *parse_name(Parser *p)
 {
 	char *start = p->pos;
 
@@ -334,13 +1243,13 @@ Prop *parse_property(Parser *p, ObjectOp *obj)
 	}
 	else {
 		// find the end of the property name
-		p->pos += strcspn(p->pos, ",[]{}");
+		p->pos += strcspn(p->pos, ",[]{}|");
 
 		if (p->pos == start)
 			return NULL;
 	}
 
-	return add_property(obj, start);
+	return start;
 }
 
 bool find_root(Op *head)
@@ -377,63 +1286,472 @@ bool find_root(Op *head)
 	return false;
 }
 
-ArrayOp *new_array_op()
+void run_input(Op *head)
 {
-	ArrayOp *op = xcalloc(1, sizeof(*op));
-	op->op.type = OP_ARRAY;
-	return op;
-}
+	jmp_buf recover;
 
-ObjectOp *new_object_op()
-{
-	ObjectOp *op = xcalloc(1, sizeof(*op));
-	op->op.type = OP_OBJECT;
-	return op;
-}
+	reset_input();
 
-CollectOp *new_collect_op(Table *t)
-{
-	CollectOp *op = xcalloc(1, sizeof(*op));
-	op->op.type = OP_COLLECT;
-	op->op.table = t;
-	op->column = t->ncols++;
-	return op;
-}
+	if (capture.on) {
+		capture.npatches = 0;
+		capture_next();
+	}
 
-Prop *add_property(ObjectOp *op, char *name)
-{
-	Prop *p = xcalloc(1, sizeof(*p));
-	p->name = name;
-	p->next = op->prop;
-	op->prop = p;
-	return p;
-}
+	// in NDJSON mode an error abandons the rest of its line, when
+	// validating it is reported and ends the input unless it is NDJSON
+	if (ndjson || validating) {
+		if (setjmp(recover)) {
+			if (validating) {
+				invalid = true;
+				fprintf(stderr, "%s: offset %" PRIu64 ": %s", lexer.name,
+						lexer.erroff, lexer.error);
+
+				if (!ndjson) {
+					lexer.recover = NULL;
+					return;
+				}
+			}
 
-Table *new_table()
-{
-	if (tables.cap == tables.len) {
-		tables.cap = tables.cap == 0 ? 4 : tables.cap * 2;
-		tables.t = xrealloc(tables.t, tables.cap * sizeof(*tables.t));
-	}
+			nbad++;
+			if (badfile)
+				fprintf(badfile, "%" PRIu64 "\n", lexer.recstart);
 
-	Table *t = xcalloc(1, sizeof(*t));
-	tables.t[tables.len++] = t;
-	return t;
-}
+			reset_tables();
+			if (sample.slot)
+				sample.slot->len = 0;
 
-void add_value(Table *t, size_t column, char *val)
-{
-	Buf *b = &t->newrow[column];
+			// skip to the end of the line, past any NUL bytes in it
+			lexer.peek = NULL;
+			lexer.unread = '\0';
+			while (read_char() != '\0' || !(lexer.eol || lexer.eof))
+				;
 
-	// reset the buffer
-	if (b->len > 0) {
-		b->len = 0;
-		b->str[0] = '\0';
+			if (capture.on)
+				capture_next();
+			route.match = route.cur = NULL;
+		}
+		lexer.recover = &recover;
 	}
 
-	size_t len = strlen(val);
-	if (len > 0) {
-		ensure_bufcap(b, len + 1);
+	for (;;) {
+		Token *t = peek_token();
+
+		if (t->type == T_EOF) {
+			if (!lexer.eol)
+				break;
+
+			// start the next line
+			lexer.eol = false;
+			lexer.peek = NULL;
+			lexer.recstart = lexer.buf.pos + lexer.buf.i;
+
+			// the next record belongs to the next chunk
+			if (lexer.end > 0 && lexer.recstart >= lexer.end)
+				break;
+			continue;
+		}
+
+		// unsampled top-level values are skipped without matching
+		if (route.len > 0 && sample_record())
+			route_scan();
+		else if (head && sample_record())
+			run_op(head);
+		else
+			skip_value();
+
+		if (grep.value)
+			grep_record();
+		else if (route.match)
+			route_record();
+
+		if (capture.on)
+			capture_next();
+
+		if (work.on && work.buf.len >= OUTSIZE)
+			work_flush();
+	}
+
+	lexer.recover = NULL;
+}
+
+void reset_input()
+{
+	lexer.buf.data = inbuf;
+	lexer.buf.i = lexer.buf.lim = lexer.buf.len = 0;
+	lexer.buf.pos = lexer.start;
+	lexer.utf8.need = lexer.utf8.have = 0;
+	lexer.unread = '\0';
+	lexer.eof = lexer.eol = false;
+	lexer.peek = NULL;
+	lexer.recstart = lexer.start;
+	lexer.frames.len = 0;
+
+	// a one-pass scan reads the file sequentially, and a large one would
+	// otherwise evict everything else from the page cache
+	struct stat st;
+	int fd = lexer.file ? fileno(lexer.file) : -1;
+
+	lexer.dropping = false;
+	lexer.dropped = lexer.start;
+
+	if (fd != -1 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		lexer.dropping = st.st_size >= DROPSIZE;
+	}
+}
+
+void reset_tables()
+{
+	for (size_t i = 0; i < tables.len; i++) {
+		Table *t = tables.t[i];
+
+		for (size_t j = 0; j < t->ncols; j++) {
+			if (t->newrow[j].len > 0) {
+				t->newrow[j].len = 0;
+				t->newrow[j].str[0] = '\0';
+			}
+		}
+
+		t->nrows = 0;
+		t->reject = false;
+	}
+}
+
+bool sample_record()
+{
+	size_t i = sample.seen++;
+
+	switch (sample.mode) {
+	case S_EVERY:
+		return i % sample.n == 0;
+	case S_BERNOULLI:
+		return random_double() < sample.p;
+	case S_RESERVOIR:
+		// the i-th value replaces a random slot with probability n/(i+1)
+		if (i >= sample.n) {
+			i = random_double() * (i + 1);
+			if (i >= sample.n)
+				return false;
+		}
+		sample.slot = &sample.slots[i];
+		sample.slot->len = 0;
+		return true;
+	default:
+		return true;
+	}
+}
+
+void grep_record()
+{
+	if (grep.matched) {
+		size_t len;
+		char *s = capture_record(&len);
+
+		write_out(s, len);
+		write_out("\n", 1);
+		grep.matched = false;
+	}
+}
+
+char *capture_record(size_t *len)
+{
+	// a record read from one buffer is used straight from it
+	char *s = lexer.buf.data + capture.from;
+	size_t n = lexer.buf.i - capture.from;
+
+	capture_restore();
+
+	if (capture.raw.len > 0) {
+		append_str(&capture.raw, s, n);
+		s = capture.raw.str;
+		n = capture.raw.len;
+	}
+
+	while (n > 0 && chars[(unsigned char)*s] & C_SPACE)
+		s++, n--;
+	while (n > 0 && chars[(unsigned char)s[n - 1]] & C_SPACE)
+		n--;
+
+	*len = n;
+	return s;
+}
+
+void capture_next()
+{
+	capture_restore();
+	capture.raw.len = 0;
+	capture.from = lexer.buf.i;
+}
+
+void capture_save()
+{
+	// keep the part of the record that the refill is about to overwrite
+	capture_restore();
+
+	if (lexer.buf.len > capture.from)
+		append_str(&capture.raw, lexer.buf.data + capture.from,
+				lexer.buf.len - capture.from);
+
+	capture.from = 0;
+}
+
+void patch_buf(char *p)
+{
+	// remember a byte of the buffer that is about to be overwritten
+	if (capture.npatches == capture.cap) {
+		capture.cap = capture.cap == 0 ? 16 : capture.cap * 2;
+		capture.patches = xrealloc(capture.patches,
+				capture.cap * sizeof(*capture.patches));
+	}
+
+	capture.patches[capture.npatches].off = p - lexer.buf.data;
+	capture.patches[capture.npatches].c = *p;
+	capture.npatches++;
+}
+
+void capture_restore()
+{
+	while (capture.npatches > 0) {
+		capture.npatches--;
+		lexer.buf.data[capture.patches[capture.npatches].off] =
+			capture.patches[capture.npatches].c;
+	}
+}
+
+void route_scan()
+{
+	// find the route from the value of the member. When no member before
+	// it is one a pattern needs, the rest of the record is matched with
+	// the pattern of the route right away, and otherwise once it has all
+	// been read.
+	Token *t = peek_token();
+	bool needed = false;
+
+	if (t->type != T_BEGINOBJECT) {
+		skip_value();
+		return;
+	}
+
+	accept(T_BEGINOBJECT);
+
+	for (t = next_key(); t->type == T_STRING; t = next_key()) {
+		bool member = !strcmp(t->text, route.name);
+
+		if (!member && !needed)
+			needed = route_needs(t->text);
+
+		accept(T_PAIRSEP);
+		t = peek_token();
+
+		if (member && is_literal(t->type)) {
+			route.match = NULL;
+			for (size_t i = 0; i < route.len; i++) {
+				if (!strcmp(route.r[i].value, t->text))
+					route.match = &route.r[i];
+			}
+
+			Op *head = route.match ? route.match->head : NULL;
+
+			if (!needed && head && head->type == OP_OBJECT) {
+				ObjectOp *op = (ObjectOp*)head;
+				Prop *p = find_prop(op, route.name);
+
+				tables = route.match->tables;
+				route.cur = route.match;
+				route.match = NULL;
+
+				if (p)
+					run_op(p->op);
+				else
+					next_token();
+
+				t = next_token();
+				run_members(op, t->type == T_MEMBERSEP ? next_key() : t);
+				route.cur = NULL;
+				return;
+			}
+			next_token();
+		}
+		else {
+			skip_value();
+		}
+
+		if ((t = next_token())->type != T_MEMBERSEP)
+			break;
+	}
+
+	if (t->type != T_ENDOBJECT)
+		fail("expected object end\n");
+}
+
+bool route_needs(const char *name)
+{
+	for (size_t i = 0; i < route.len; i++) {
+		Op *head = route.r[i].head;
+
+		if (head->type != OP_OBJECT || find_prop((ObjectOp*)head, name))
+			return true;
+	}
+
+	return false;
+}
+
+void route_record()
+{
+	// the record was read without errors, so matching its text again
+	// should not fail; if it does, the error is raised once the input is
+	// back in place
+	static struct lexer saved;
+	char error[sizeof(lexer.error)] = "";
+	jmp_buf recover;
+	size_t len;
+	char *s = capture_record(&len);
+
+	saved = lexer;
+	capture.on = false;
+
+	lexer.file = NULL;
+	reset_input();
+	lexer.buf.data = s;
+	lexer.buf.len = lexer.buf.lim = len;
+	lexer.recover = &recover;
+
+	if (!setjmp(recover)) {
+		tables = route.match->tables;
+		route.cur = route.match;
+		run_op(route.match->head);
+	}
+	else {
+		memcpy(error, lexer.error, sizeof(error));
+	}
+
+	route.cur = route.match = NULL;
+
+	// the text of the tokens may have moved
+	Buf text = lexer.text;
+	lexer = saved;
+	lexer.text = text;
+	capture.on = true;
+
+	if (error[0] != '\0')
+		fail("%s", error);
+}
+
+void sample_finish()
+{
+	size_t n = sample.seen < sample.n ? sample.seen : sample.n;
+	sample.slot = NULL;
+
+	for (size_t i = 0; i < n; i++) {
+		Buf *b = &sample.slots[i];
+
+		for (size_t off = 0; off < b->len; ) {
+			Row r;
+			memcpy(&r, b->str + off, sizeof(r));
+			r.str = b->str + off + sizeof(r);
+			off += sizeof(r) + r.len;
+			output_row(&r);
+		}
+	}
+}
+
+double random_double()
+{
+	// xorshift64*
+	sample.random ^= sample.random >> 12;
+	sample.random ^= sample.random << 25;
+	sample.random ^= sample.random >> 27;
+	uint64_t x = sample.random * UINT64_C(2685821657736338717);
+	return (x >> 11) * (1.0 / (UINT64_C(1) << 53));
+}
+
+void put_row(Buf *b, Row *r)
+{
+	ensure_bufcap(b, b->len + sizeof(*r) + r->len);
+	memcpy(b->str + b->len, r, sizeof(*r));
+	memcpy(b->str + b->len + sizeof(*r), r->str, r->len);
+	b->len += sizeof(*r) + r->len;
+}
+
+ArrayOp *new_array_op()
+{
+	ArrayOp *op = xcalloc(1, sizeof(*op));
+	op->op.type = OP_ARRAY;
+	return op;
+}
+
+ObjectOp *new_object_op()
+{
+	ObjectOp *op = xcalloc(1, sizeof(*op));
+	op->op.type = OP_OBJECT;
+	return op;
+}
+
+CollectOp *new_collect_op(Table *t)
+{
+	CollectOp *op = xcalloc(1, sizeof(*op));
+	op->op.type = OP_COLLECT;
+	op->op.table = t;
+	op->column = t->ncols++;
+	return op;
+}
+
+Prop *add_property(ObjectOp *op, char *name)
+{
+	Prop *p = xcalloc(1, sizeof(*p));
+	p->name = name;
+	p->next = op->prop;
+	op->prop = p;
+	return p;
+}
+
+Table *new_table()
+{
+	if (tables.cap == tables.len) {
+		tables.cap = tables.cap == 0 ? 4 : tables.cap * 2;
+		tables.t = xrealloc(tables.t, tables.cap * sizeof(*tables.t));
+	}
+
+	Table *t = xcalloc(1, sizeof(*t));
+	tables.t[tables.len++] = t;
+	return t;
+}
+
+void add_value(Table *t, size_t column, char *val, bool str)
+{
+	if (t->reject)
+		return;
+
+	// reject rows that cannot make it into the top before copying
+	if (topn && t->field + column == keyfield) {
+		double key;
+		if (!parse_number(val, strlen(val), &key) || !top_accepts(key)) {
+			t->reject = true;
+			return;
+		}
+	}
+
+	Buf *b = &t->newrow[column];
+
+	// reset the buffer
+	if (b->len > 0) {
+		b->len = 0;
+		b->str[0] = '\0';
+	}
+
+	size_t len = strlen(val);
+
+	// JSON output keeps strings quoted, and escaped again if decoded
+	if (jsonout && str) {
+		append_char(b, '"');
+		if (decoding)
+			append_escaped(b, val, len);
+		else
+			append_str(b, val, len);
+		append_char(b, '"');
+	}
+	else if (len > 0) {
+		ensure_bufcap(b, len + 1);
 		memcpy(b->str, val, len);
 		b->len = len;
 		b->str[b->len] = '\0';
@@ -451,13 +1769,39 @@ void add_row(Table *t)
 		}
 	}
 
+	if (t->reject) {
+		for (size_t i = 0; i < t->ncols; i++) {
+			if (t->newrow[i].len > 0) {
+				t->newrow[i].len = 0;
+				t->newrow[i].str[0] = '\0';
+			}
+		}
+		t->reject = false;
+		hasval = false;
+	}
+
 	if  (hasval) {
 		if (t->nrows == t->rowcap) {
-			t->rowcap = t->rowcap == 0 ? 4 : t->rowcap * 2;
-			t->rows = xrealloc(t->rows, t->rowcap * sizeof(*t->rows));
+			size_t cap = t->rowcap == 0 ? 4 : t->rowcap * 2;
+			t->rows = xrealloc(t->rows, cap * sizeof(*t->rows));
+			memset(t->rows + t->rowcap, 0, (cap - t->rowcap) * sizeof(*t->rows));
+			t->rowcap = cap;
 		}
+
+		// the row in the slot is left from an earlier record, and is reused
+		Buf *row = t->rows[t->nrows];
 		t->rows[t->nrows++] = t->newrow;
-		t->newrow = xcalloc(t->ncols, sizeof(*t->newrow));
+
+		if (!row)
+			row = xcalloc(t->ncols, sizeof(*row));
+
+		for (size_t i = 0; i < t->ncols; i++) {
+			if (row[i].len > 0) {
+				row[i].len = 0;
+				row[i].str[0] = '\0';
+			}
+		}
+		t->newrow = row;
 	}
 }
 
@@ -478,11 +1822,23 @@ void flush_tables()
 	if (!hasrows)
 		return;
 
-	// emit rows
+	if (norm.prefix) {
+		norm.record++;
+
+		for (size_t i = 0; i < tables.len; i++) {
+			Table *t = tables.t[i];
+			for (size_t j = 0; j < t->nrows; j++)
+				write_table_row(t, t->rows[j], norm.files[i]);
+			t->nrows = 0;
+		}
+		return;
+	}
+
+	// emit rows, unless only the quantiles are reported
 	size_t rowindex[tables.len];
 	memset(rowindex, 0, sizeof(rowindex));
 
-	for (size_t i = 0; i < nrows; i++) {
+	for (size_t i = 0; i < nrows && !quantiles; i++) {
 		for (size_t j = 0; j < tables.len; j++) {
 			Table *tab = tables.t[j];
 			if (tab->nrows > 0)
@@ -497,124 +1853,2124 @@ void flush_tables()
 		tables.t[i]->nrows = 0;
 }
 
-void emit_row(size_t *rowindex)
+void join_load()
 {
-	for (size_t i = 0; i < tables.len; i++) {
-		Table *t = tables.t[i];
+	FILE *f = fopen(join.path, "r");
+	if (!f)
+		die("%s: %s\n", join.path, strerror(errno));
+
+	Buf key = { 0 }, val = { 0 };
+	int c = getc(f);
+
+	while (c != EOF && chars[c] & C_SPACE)
+		c = getc(f);
+	if (c != EOF)
+		ungetc(c, f);
+
+	if (c != '{') {
+		// tab-separated lines, the first field being the key
+		char *s = NULL;
+		size_t cap = 0;
+		ssize_t len;
+
+		while ((len = getline(&s, &cap, f)) > 0) {
+			while (len > 0 && (s[len - 1] == '\n' || s[len - 1] == '\r'))
+				len--;
+
+			char *tab = memchr(s, '\t', len);
+			size_t keylen = tab ? (size_t)(tab - s) : (size_t)len, ncols = 0;
+
+			key.len = val.len = 0;
+			append_str(&key, s, keylen);
+			append_str(&val, "", 0);
+
+			for (char *p = tab; p; ncols++) {
+				char *start = p + 1, *next = memchr(start, '\t', s + len - start);
+				size_t n = next ? (size_t)(next - start) : (size_t)(s + len - start);
+
+				if (ncols > 0)
+					append_str(&val, fieldsep, strlen(fieldsep));
+				append_str(&val, start, n);
+				p = next;
+			}
 
-		Buf *row = NULL;
-		if (t->nrows > 0)
-			row = t->rows[rowindex[i]];
+			join_add(&key, &val, ncols);
+		}
 
-		for (size_t j = 0; j < t->ncols; j++) {
-			if (i > 0 || j > 0)
-				fputs(fieldsep, stdout);
+		if (ferror(f))
+			die("%s: %s\n", join.path, strerror(errno));
 
-			if (row && row[j].str)
-				fputs(row[j].str, stdout);
-		}
+		free(s);
 	}
+	else {
+		// objects of scalars, the first member being the key
+		const TokenSource *source = lexer.source;
+		bool nd = ndjson;
 
-	putc('\n', stdout);
-}
+		lexer.source = &json_source;
+		lexer.file = f;
+		lexer.name = (char*)join.path;
+		ndjson = false;
+		reset_input();
 
-Token *next_token()
-{
-	if (lexer.peek) {
-		Token *t = lexer.peek;
-		lexer.peek = NULL;
-		return t;
-	}
+		for (Token *t = next_token(); t->type != T_EOF; t = next_token()) {
+			size_t ncols = 0;
+			bool first = true;
 
-	lexer.token.text = NULL;
+			if (t->type != T_BEGINOBJECT)
+				fail("%s: expected object\n", join.path);
 
-	if (lexer.text.len > 0) {
-		lexer.text.str[0] = '\0';
-		lexer.text.len = 0;
-	}
+			key.len = val.len = 0;
+			append_str(&key, "", 0);
+			append_str(&val, "", 0);
 
-	read_token();
+			for (t = next_key(); t->type == T_STRING; t = next_key()) {
+				accept(T_PAIRSEP);
+				t = next_token();
 
-	if (!lexer.token.text)
-		lexer.token.text = lexer.text.str ? lexer.text.str : "";
+				if (!is_literal(t->type))
+					fail("%s: expected a string, number or literal\n", join.path);
 
-	return &lexer.token;
-}
+				if (first) {
+					append_str(&key, t->text, strlen(t->text));
+					first = false;
+				}
+				else {
+					if (ncols++ > 0)
+						append_str(&val, fieldsep, strlen(fieldsep));
+					append_str(&val, t->text, strlen(t->text));
+				}
 
-Token *peek_token()
-{
-	if (!lexer.peek)
-		lexer.peek = next_token();
+				if ((t = next_token())->type != T_MEMBERSEP)
+					break;
+			}
 
-	return lexer.peek;
+			if (t->type != T_ENDOBJECT)
+				fail("%s: expected object end\n", join.path);
+
+			join_add(&key, &val, ncols);
+		}
+
+		lexer.source = source;
+		ndjson = nd;
+	}
+
+	xfree(key.str);
+	xfree(val.str);
+	fclose(f);
+}
+
+void join_add(Buf *key, Buf *val, size_t ncols)
+{
+	// the first line with a key is the one used
+	uint64_t hash = hash_bytes(key->str, key->len);
+
+	if (set_find(&join.set, key->str, key->len, hash))
+		return;
+
+	SetEntry *e = set_add(&join.set, key->str, key->len, hash,
+			sizeof(ncols) + val->len + 1);
+	memcpy(e->str + e->len + 1, &ncols, sizeof(ncols));
+	memcpy(e->str + e->len + 1 + sizeof(ncols), val->str, val->len + 1);
+
+	if (ncols > join.ncols)
+		join.ncols = ncols;
+}
+
+bool join_row(size_t off, size_t len)
+{
+	// append the fields of the lookup line for the key to the row
+	char *key = line.str ? line.str + off : "";
+	SetEntry *e = set_find(&join.set, key, len, hash_bytes(key, len));
+
+	if (!e && join.inner)
+		return false;
+
+	size_t ncols = 0;
+
+	if (e) {
+		char *val = e->str + e->len + 1 + sizeof(ncols);
+		memcpy(&ncols, e->str + e->len + 1, sizeof(ncols));
+
+		if (ncols > 0)
+			append_str(&line, fieldsep, strlen(fieldsep));
+		append_str(&line, val, strlen(val));
+	}
+
+	for (size_t i = ncols; i < join.ncols; i++)
+		append_str(&line, fieldsep, strlen(fieldsep));
+
+	return true;
+}
+
+void write_table_row(Table *t, Buf *row, FILE *f)
+{
+	if (jsonout)
+		fprintf(f, "{\"record\":%" PRIu64, norm.record);
+	else
+		fprintf(f, "%" PRIu64, norm.record);
+
+	for (size_t j = 0; j < t->ncols; j++) {
+		if (jsonout) {
+			static Buf name;
+			name.len = 0;
+			append_name(&name, t->names[j]);
+			fprintf(f, ",\"%s\":", name.str);
+		}
+		else
+			fputs(fieldsep, f);
+
+		if (row[j].len > 0)
+			fwrite(row[j].str, 1, row[j].len, f);
+		else if (jsonout)
+			fputs("null", f);
+	}
+
+	fputs(jsonout ? "}\n" : "\n", f);
+}
+
+void emit_row(size_t *rowindex)
+{
+	Row r = { 0 };
+	size_t joinoff = 0, joinlen = 0;
+	line.len = 0;
+
+	// rows of a route start with its value
+	if (route.cur && jsonout) {
+		append_str(&line, "{\"", 2);
+		append_name(&line, route.name);
+		append_str(&line, "\":\"", 3);
+		append_name(&line, route.cur->value);
+		append_char(&line, '"');
+	}
+	else if (route.cur) {
+		append_str(&line, route.cur->value, strlen(route.cur->value));
+		append_str(&line, fieldsep, strlen(fieldsep));
+	}
+
+	for (size_t i = 0; i < tables.len; i++) {
+		Table *t = tables.t[i];
+
+		Buf *row = NULL;
+		if (t->nrows > 0)
+			row = t->rows[rowindex[i]];
+
+		for (size_t j = 0; j < t->ncols; j++) {
+			if (jsonout) {
+				append_str(&line, i > 0 || j > 0 || route.cur ? ",\"" : "{\"", 2);
+				append_name(&line, t->names[j]);
+				append_str(&line, "\":", 2);
+			}
+			else if (i > 0 || j > 0) {
+				append_str(&line, fieldsep, strlen(fieldsep));
+			}
+
+			if (t->field + j == keyfield)
+				r.keyoff = line.len;
+			if (t->field + j == join.field)
+				joinoff = line.len;
+
+			if (row && row[j].len > 0)
+				append_str(&line, row[j].str, row[j].len);
+			else if (jsonout)
+				append_str(&line, "null", 4);
+
+			if (t->field + j == join.field)
+				joinlen = line.len - joinoff;
+
+			if (t->field + j == keyfield) {
+				r.keylen = line.len - r.keyoff;
+
+				// the key is the value without its JSON quoting
+				if (jsonout && !(row && row[j].len > 0))
+					r.keylen = 0;
+				else if (jsonout && line.str[r.keyoff] == '"')
+					r.keyoff++, r.keylen -= 2;
+			}
+		}
+	}
+
+	if (jsonout)
+		append_char(&line, '}');
+
+	if (join.path && !join_row(joinoff, joinlen))
+		return;
+
+	r.str = line.str ? line.str : "";
+	r.len = line.len;
+
+	if (sample.mode == S_HASH) {
+		// map the hash of the key to [0, 1) so the same keys are always picked
+		uint64_t h = hash_bytes(r.str + r.keyoff, r.keylen);
+		if ((h >> 11) * (1.0 / (UINT64_C(1) << 53)) >= sample.p)
+			return;
+	}
+
+	if (grep.value) {
+		if (r.keylen == strlen(grep.value) &&
+				!memcmp(r.str + r.keyoff, grep.value, r.keylen))
+			grep.matched = true;
+	}
+	else if (sample.slot) {
+		put_row(sample.slot, &r);
+	}
+	else {
+		output_row(&r);
+	}
+}
+
+void output_row(Row *r)
+{
+	if (unique)
+		distinct_row(&distinct, r, hash_bytes(r->str, r->len));
+	else
+		deliver_row(r);
+}
+
+void deliver_row(Row *r)
+{
+	if (topn)
+		top_row(r);
+	else if (sorting)
+		sort_row(r);
+	else
+		write_row(r);
+}
+
+void write_row(Row *r)
+{
+	write_out(r->str, r->len);
+	write_out("\n", 1);
+}
+
+void write_out(const char *s, size_t len)
+{
+	if (work.on)
+		append_str(&work.buf, s, len);
+	else if (out.splicing)
+		splice_out(s, len);
+	else
+		fwrite(s, 1, len, stdout);
+
+	if (cache.file)
+		fwrite(s, 1, len, cache.file);
+}
+
+void spill_row(FILE *f, Row *r)
+{
+	size_t hdr[] = { r->len, r->keyoff, r->keylen };
+
+	if (fwrite(hdr, sizeof(hdr), 1, f) != 1 ||
+			fwrite(r->str, 1, r->len, f) != r->len)
+		die("write: %s\n", strerror(errno));
+}
+
+bool unspill_row(FILE *f, Buf *b, Row *r)
+{
+	size_t hdr[3];
+
+	if (fread(hdr, sizeof(hdr), 1, f) != 1) {
+		if (ferror(f))
+			die("read: %s\n", strerror(errno));
+		return false;
+	}
+
+	ensure_bufcap(b, hdr[0] + 1);
+	if (fread(b->str, 1, hdr[0], f) != hdr[0])
+		die("read: %s\n", strerror(errno));
+
+	r->str = b->str;
+	r->len = hdr[0];
+	r->keyoff = hdr[1];
+	r->keylen = hdr[2];
+	return true;
+}
+
+bool parse_number(const char *s, size_t len, double *v)
+{
+	char num[128], *end;
+
+	if (len == 0 || len >= sizeof(num))
+		return false;
+
+	memcpy(num, s, len);
+	num[len] = '\0';
+	*v = strtod(num, &end);
+
+	// NaN never compares greater than anything, so it cannot rank
+	return end == num + len && *v == *v;
+}
+
+bool top_accepts(double key)
+{
+	return top.len < topn || key > top.e[0].key;
+}
+
+void top_row(Row *r)
+{
+	double key;
+
+	if (!parse_number(r->str + r->keyoff, r->keylen, &key) || !top_accepts(key))
+		return;
+
+	size_t i;
+
+	if (top.len < topn) {
+		// sift the new entry up from the bottom of the min-heap
+		i = top.len++;
+		TopEntry e = top.e[i];
+
+		while (i > 0 && top.e[(i - 1) / 2].key > key) {
+			top.e[i] = top.e[(i - 1) / 2];
+			i = (i - 1) / 2;
+		}
+		top.e[i] = e;
+	}
+	else {
+		// replace the smallest entry, reusing its buffer
+		i = 0;
+	}
+
+	TopEntry *e = &top.e[i];
+	e->key = key;
+	e->line.len = 0;
+	append_str(&e->line, r->str, r->len);
+
+	if (i == 0)
+		top_siftdown(0);
+}
+
+void top_siftdown(size_t i)
+{
+	TopEntry e = top.e[i];
+
+	for (;;) {
+		size_t c = 2 * i + 1;
+		if (c >= top.len)
+			break;
+		if (c + 1 < top.len && top.e[c + 1].key < top.e[c].key)
+			c++;
+		if (top.e[c].key >= e.key)
+			break;
+		top.e[i] = top.e[c];
+		i = c;
+	}
+
+	top.e[i] = e;
+}
+
+void top_finish()
+{
+	qsort(top.e, top.len, sizeof(*top.e), cmp_top);
+
+	for (size_t i = 0; i < top.len; i++) {
+		Row r = { .str = top.e[i].line.str, .len = top.e[i].line.len };
+		write_row(&r);
+	}
+}
+
+int cmp_top(const void *a, const void *b)
+{
+	double x = ((const TopEntry*)a)->key, y = ((const TopEntry*)b)->key;
+	return (x < y) - (x > y);
+}
+
+void sort_row(Row *r)
+{
+	if (sorter.len == sorter.cap) {
+		sorter.cap = sorter.cap == 0 ? 1024 : sorter.cap * 2;
+		sorter.e = xrealloc(sorter.e, sorter.cap * sizeof(*sorter.e));
+	}
+
+	SortEntry *e = &sorter.e[sorter.len++];
+	e->row = *r;
+	e->row.str = arena_alloc(&sorter.arena, r->len);
+	memcpy(e->row.str, r->str, r->len);
+	e->isnum = parse_number(r->str + r->keyoff, r->keylen, &e->num);
+	e->seq = sorter.seq++;
+
+	if (sorter.arena.size + sorter.cap * sizeof(*sorter.e) >= membudget)
+		spill_run();
+}
+
+void spill_run()
+{
+	FILE *f = tmpfile();
+	if (!f)
+		die("tmpfile: %s\n", strerror(errno));
+
+	sort_run(f);
+
+	// merge the runs into one when there are too many to merge at once
+	if (sorter.nruns == MAXRUNS) {
+		FILE *m = tmpfile();
+		if (!m)
+			die("tmpfile: %s\n", strerror(errno));
+
+		merge_runs(m);
+		sorter.runs[sorter.nruns++] = m;
+	}
+
+	sorter.runs[sorter.nruns++] = f;
+}
+
+void sort_run(FILE *out)
+{
+	// sort a slice of the run on each thread, then merge the slices
+	size_t n = sorter.len < 65536 ? 1 : nthreads;
+	size_t per = (sorter.len + n - 1) / n;
+
+	MergeSource *src = xcalloc(n, sizeof(*src));
+	pthread_t *tid = xcalloc(n, sizeof(*tid));
+
+	for (size_t i = 0; i < n; i++) {
+		size_t lo = i * per < sorter.len ? i * per : sorter.len;
+		size_t hi = lo + per < sorter.len ? lo + per : sorter.len;
+		src[i].next = sorter.e + lo;
+		src[i].end = sorter.e + hi;
+		src[i].index = i;
+
+		int err = i > 0 ? pthread_create(&tid[i], NULL, sort_slice, &src[i]) : 0;
+		if (err)
+			die("pthread_create: %s\n", strerror(err));
+	}
+
+	sort_slice(&src[0]);
+
+	for (size_t i = 1; i < n; i++)
+		pthread_join(tid[i], NULL);
+
+	merge(src, n, out);
+
+	xfree(tid);
+	xfree(src);
+	sorter.len = 0;
+	arena_free(&sorter.arena);
+}
+
+void *sort_slice(void *arg)
+{
+	MergeSource *m = arg;
+	qsort(m->next, m->end - m->next, sizeof(*m->next), cmp_sort);
+	return NULL;
+}
+
+void sort_finish()
+{
+	if (sorter.nruns == 0) {
+		sort_run(NULL);
+		return;
+	}
+
+	if (sorter.len > 0)
+		spill_run();
+
+	merge_runs(NULL);
+}
+
+void merge_runs(FILE *out)
+{
+	MergeSource *src = xcalloc(sorter.nruns, sizeof(*src));
+	for (size_t i = 0; i < sorter.nruns; i++) {
+		src[i].f = sorter.runs[i];
+		src[i].index = i;
+		rewind(src[i].f);
+	}
+
+	merge(src, sorter.nruns, out);
+
+	for (size_t i = 0; i < sorter.nruns; i++) {
+		fclose(src[i].f);
+		xfree(src[i].buf.str);
+	}
+	xfree(src);
+	sorter.nruns = 0;
+}
+
+void merge(MergeSource *src, size_t n, FILE *out)
+{
+	MergeSource **heap = xcalloc(n, sizeof(*heap));
+	size_t len = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		if (merge_advance(&src[i]))
+			heap[len++] = &src[i];
+	}
+
+	for (size_t i = len; i-- > 0; )
+		merge_siftdown(heap, len, i);
+
+	// ties go to the source with the lower index, which keeps the sort
+	// stable since sources are in input order
+	while (len > 0) {
+		Row *r = &heap[0]->cur.row;
+
+		if (out)
+			spill_row(out, r);
+		else
+			write_row(r);
+
+		if (!merge_advance(heap[0]))
+			heap[0] = heap[--len];
+
+		merge_siftdown(heap, len, 0);
+	}
+
+	xfree(heap);
+}
+
+bool merge_advance(MergeSource *m)
+{
+	if (!m->f) {
+		if (m->next == m->end)
+			return false;
+		m->cur = *m->next++;
+		return true;
+	}
+
+	if (!unspill_row(m->f, &m->buf, &m->cur.row))
+		return false;
+
+	Row *r = &m->cur.row;
+	m->cur.isnum = parse_number(r->str + r->keyoff, r->keylen, &m->cur.num);
+	return true;
+}
+
+void merge_siftdown(MergeSource **heap, size_t n, size_t i)
+{
+	for (;;) {
+		size_t c = 2 * i + 1;
+		if (c >= n)
+			break;
+		if (c + 1 < n && cmp_source(heap[c + 1], heap[c]) < 0)
+			c++;
+		if (cmp_source(heap[c], heap[i]) >= 0)
+			break;
+
+		MergeSource *tmp = heap[i];
+		heap[i] = heap[c];
+		heap[c] = tmp;
+		i = c;
+	}
+}
+
+int cmp_sort(const void *a, const void *b)
+{
+	const SortEntry *x = a, *y = b;
+
+	// numbers sort before other values and are compared by value
+	if (x->isnum != y->isnum)
+		return x->isnum ? -1 : 1;
+
+	if (x->isnum) {
+		if (x->num != y->num)
+			return x->num < y->num ? -1 : 1;
+	}
+	else {
+		size_t n = x->row.keylen < y->row.keylen ? x->row.keylen : y->row.keylen;
+		int c = memcmp(x->row.str + x->row.keyoff, y->row.str + y->row.keyoff, n);
+		if (c != 0)
+			return c;
+		if (x->row.keylen != y->row.keylen)
+			return x->row.keylen < y->row.keylen ? -1 : 1;
+	}
+
+	return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+int cmp_source(const MergeSource *a, const MergeSource *b)
+{
+	SortEntry x = a->cur, y = b->cur;
+	x.seq = a->index;
+	y.seq = b->index;
+	return cmp_sort(&x, &y);
+}
+
+void distinct_row(Distinct *d, Row *r, uint64_t hash)
+{
+	if (set_find(&d->set, r->str, r->len, hash))
+		return;
+
+	// once the set is full, rows it has not seen are deferred to the
+	// partition selected by the next unused bits of the hash
+	if (set_size(&d->set) >= membudget && d->depth < 64 / 4) {
+		int shift = 60 - 4 * d->depth;
+		FILE **f = &d->part[(hash >> shift) % NPARTS];
+
+		if (!*f && !(*f = tmpfile()))
+			die("tmpfile: %s\n", strerror(errno));
+
+		spill_row(*f, r);
+		return;
+	}
+
+	set_insert(&d->set, r->str, r->len, hash);
+	deliver_row(r);
+}
+
+void distinct_finish(Distinct *d)
+{
+	set_free(&d->set);
+
+	for (int i = 0; i < NPARTS; i++) {
+		FILE *f = d->part[i];
+		if (!f)
+			continue;
+
+		Distinct sub = { .depth = d->depth + 1 };
+		Buf b = { 0 };
+		Row r;
+
+		rewind(f);
+		while (unspill_row(f, &b, &r))
+			distinct_row(&sub, &r, hash_bytes(r.str, r.len));
+
+		fclose(f);
+		xfree(b.str);
+		distinct_finish(&sub);
+	}
+}
+
+bool set_insert(StrSet *s, char *str, size_t len, uint64_t hash)
+{
+	if (set_find(s, str, len, hash))
+		return false;
+
+	set_add(s, str, len, hash, 0);
+	return true;
+}
+
+SetEntry *set_add(StrSet *s, char *str, size_t len, uint64_t hash, size_t extra)
+{
+	// add a string known not to be in the set, with room for extra bytes
+	// after its terminator
+	if (2 * (s->len + 1) > s->cap) {
+		StrSet n = { .len = s->len, .cap = s->cap ? s->cap * 2 : 1024 };
+		n.e = xcalloc(n.cap, sizeof(*n.e));
+		n.arena = s->arena;
+
+		for (size_t i = 0; i < s->cap; i++) {
+			if (!s->e[i].str)
+				continue;
+
+			size_t j = s->e[i].hash & (n.cap - 1);
+			while (n.e[j].str)
+				j = (j + 1) & (n.cap - 1);
+			n.e[j] = s->e[i];
+		}
+
+		xfree(s->e);
+		*s = n;
+	}
+
+	size_t mask = s->cap - 1, i = hash & mask;
+	while (s->e[i].str)
+		i = (i + 1) & mask;
+
+	// the terminator keeps empty strings apart from empty slots
+	SetEntry *e = &s->e[i];
+	e->str = arena_alloc(&s->arena, len + 1 + extra);
+	memcpy(e->str, str, len);
+	e->str[len] = '\0';
+	e->len = len;
+	e->hash = hash;
+	s->len++;
+	return e;
+}
+
+SetEntry *set_find(StrSet *s, char *str, size_t len, uint64_t hash)
+{
+	if (s->cap == 0)
+		return NULL;
+
+	size_t mask = s->cap - 1;
+	for (size_t i = hash & mask; s->e[i].str; i = (i + 1) & mask) {
+		SetEntry *e = &s->e[i];
+		if (e->hash == hash && e->len == len && !memcmp(e->str, str, len))
+			return e;
+	}
+
+	return NULL;
+}
+
+size_t set_size(StrSet *s)
+{
+	return s->arena.size + s->cap * sizeof(*s->e);
+}
+
+void set_free(StrSet *s)
+{
+	xfree(s->e);
+	arena_free(&s->arena);
+	memset(s, 0, sizeof(*s));
+}
+
+uint64_t hash_bytes(const char *s, size_t len)
+{
+	// FNV-1a followed by a finalizer that mixes into the high bits
+	uint64_t h = UINT64_C(0xcbf29ce484222325);
+	for (size_t i = 0; i < len; i++) {
+		h ^= (unsigned char)s[i];
+		h *= UINT64_C(0x100000001b3);
+	}
+
+	h ^= h >> 33;
+	h *= UINT64_C(0xff51afd7ed558ccd);
+	h ^= h >> 33;
+	return h;
+}
+
+void *arena_alloc(Arena *a, size_t size)
+{
+	Block *b = a->head;
+
+	if (!b || b->cap - b->len < size) {
+		size_t cap = size > 65536 ? size : 65536;
+		b = xcalloc(1, sizeof(*b) + cap);
+		b->cap = cap;
+		b->next = a->head;
+		a->head = b;
+		a->size += sizeof(*b) + cap;
+	}
+
+	void *p = b->data + b->len;
+	b->len += size;
+	return p;
+}
+
+void arena_free(Arena *a)
+{
+	while (a->head) {
+		Block *b = a->head;
+		a->head = b->next;
+		xfree(b);
+	}
+	a->size = 0;
+}
+
+void td_add(TDigest *td, double mean, double weight)
+{
+	if (td->len == TD_SIZE)
+		td_compress(td);
+
+	// compression cannot leave the digest full, but if it did the value
+	// would go to the nearest centroid
+	if (td->len == TD_SIZE) {
+		Centroid *c = td->c;
+		for (size_t i = 1; i < td->len; i++) {
+			if (fabs(td->c[i].mean - mean) < fabs(c->mean - mean))
+				c = &td->c[i];
+		}
+
+		c->weight += weight;
+		c->mean += (mean - c->mean) * weight / c->weight;
+		td->total += weight;
+		return;
+	}
+
+	if (td->total == 0 || mean < td->min)
+		td->min = mean;
+	if (td->total == 0 || mean > td->max)
+		td->max = mean;
+
+	td->c[td->len].mean = mean;
+	td->c[td->len].weight = weight;
+	td->len++;
+	td->total += weight;
+}
+
+void td_compress(TDigest *td)
+{
+	if (td->len == 0 || td->merged == td->len)
+		return;
+
+	qsort(td->c, td->len, sizeof(*td->c), cmp_centroid);
+
+	// merge neighbouring centroids while they span at most one unit of
+	// the scale function, which is finer at the tails
+	size_t n = 0;
+	double wsofar = 0, limit = td_limit(0);
+
+	for (size_t i = 1; i < td->len; i++) {
+		Centroid *cur = &td->c[n], *x = &td->c[i];
+		double w = cur->weight + x->weight;
+
+		if ((wsofar + w) / td->total <= limit) {
+			cur->mean += (x->mean - cur->mean) * x->weight / w;
+			cur->weight = w;
+		}
+		else {
+			wsofar += cur->weight;
+			limit = td_limit(wsofar / td->total);
+			td->c[++n] = *x;
+		}
+	}
+
+	td->merged = td->len = n + 1;
+}
+
+double td_limit(double q)
+{
+	// the quantile one unit of k1(q) = d / 2pi * asin(2q - 1) past q
+	const double pi = 3.14159265358979323846;
+	double k = TD_COMPRESSION / (2 * pi) * asin(2 * q - 1) + 1;
+
+	if (k >= TD_COMPRESSION / 4.0)
+		return 1;
+	return (sin(k * 2 * pi / TD_COMPRESSION) + 1) / 2;
+}
+
+double td_quantile(TDigest *td, double q)
+{
+	td_compress(td);
+
+	Centroid *c = td->c;
+	size_t n = td->len;
+	double index = q * td->total;
+
+	// interpolate between the centers of the two surrounding centroids,
+	// using the extremes for the outer halves of the first and last one
+	double center = c[0].weight / 2;
+	if (index <= center)
+		return td->min + (c[0].mean - td->min) * index / center;
+
+	for (size_t i = 0; i + 1 < n; i++) {
+		double next = center + (c[i].weight + c[i + 1].weight) / 2;
+		if (index <= next) {
+			double f = (index - center) / (next - center);
+			return c[i].mean + (c[i + 1].mean - c[i].mean) * f;
+		}
+		center = next;
+	}
+
+	double rest = td->total - center;
+	return c[n - 1].mean + (td->max - c[n - 1].mean) * (index - center) / rest;
+}
+
+void td_merge(TDigest *td, TDigest *from)
+{
+	// the centroids are added as weighted values, and the extremes kept
+	if (from->total == 0)
+		return;
+
+	td_compress(from);
+
+	double min = td->total == 0 || from->min < td->min ? from->min : td->min;
+	double max = td->total == 0 || from->max > td->max ? from->max : td->max;
+
+	for (size_t i = 0; i < from->len; i++)
+		td_add(td, from->c[i].mean, from->c[i].weight);
+
+	td->min = min;
+	td->max = max;
+}
+
+int cmp_centroid(const void *a, const void *b)
+{
+	double x = ((const Centroid*)a)->mean, y = ((const Centroid*)b)->mean;
+	return (x > y) - (x < y);
+}
+
+void print_quantiles()
+{
+	static const struct {
+		const char *name;
+		double q;
+	} qs[] = {
+		{ "p50", 0.5 },
+		{ "p90", 0.9 },
+		{ "p99", 0.99 },
+		{ "p999", 0.999 },
+	};
+
+	if (digest.total == 0)
+		return;
+
+	for (size_t i = 0; i < sizeof(qs) / sizeof(*qs); i++) {
+		line.len = 0;
+		append_str(&line, qs[i].name, strlen(qs[i].name));
+		append_str(&line, fieldsep, strlen(fieldsep));
+
+		char num[32];
+		int n = snprintf(num, sizeof(num), "%g\n", td_quantile(&digest, qs[i].q));
+		append_str(&line, num, n);
+
+		write_out(line.str, line.len);
+	}
+}
+
+void out_start()
+{
+#ifdef __linux__
+	struct stat st;
+
+	if (!splicing || fstat(STDOUT_FILENO, &st) != 0 || !S_ISFIFO(st.st_mode))
+		return;
+
+	int cap = fcntl(STDOUT_FILENO, F_GETPIPE_SZ);
+	if (cap <= 0)
+		return;
+
+	long page = sysconf(_SC_PAGESIZE);
+	void *ring;
+
+	out.nbufs = cap / OUTSIZE + 2;
+	if (posix_memalign(&ring, page > 0 ? page : 4096, out.nbufs * OUTSIZE) != 0)
+		return;
+
+	out.ring = ring;
+	out.splicing = true;
+	atexit(out_flush);
+#endif
+}
+
+void out_flush()
+{
+	// this runs at exit, where die cannot exit again
+	if (out.splicing && out.len > 0 && !splice_buf()) {
+		fprintf(stderr, "write: %s\n", strerror(errno));
+		_exit(1);
+	}
+}
+
+void splice_out(const char *s, size_t len)
+{
+	while (len > 0 && out.splicing) {
+		size_t n = OUTSIZE - out.len < len ? OUTSIZE - out.len : len;
+
+		memcpy(out.ring + out.cur * OUTSIZE + out.len, s, n);
+		out.len += n;
+		s += n;
+		len -= n;
+
+		if (out.len == OUTSIZE && !splice_buf())
+			die("write: %s\n", strerror(errno));
+	}
+
+	if (len > 0)
+		fwrite(s, 1, len, stdout);
+}
+
+bool splice_buf()
+{
+#ifdef __linux__
+	struct iovec iov = { out.ring + out.cur * OUTSIZE, out.len };
+
+	while (iov.iov_len > 0) {
+		ssize_t n = vmsplice(STDOUT_FILENO, &iov, 1, 0);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n < 0) {
+			out.splicing = false;
+			return false;
+		}
+
+		iov.iov_base = (char*)iov.iov_base + n;
+		iov.iov_len -= n;
+	}
+
+	out.len = 0;
+	out.cur = (out.cur + 1) % out.nbufs;
+
+	// the reader may have grown the pipe past what the ring covers; the
+	// ring is then left to the pipe and output is copied instead
+	if (out.cur == 0) {
+		int cap = fcntl(STDOUT_FILENO, F_GETPIPE_SZ);
+		if (cap < 0 || (size_t)cap > (out.nbufs - 1) * OUTSIZE)
+			out.splicing = false;
+	}
+#endif
+	return true;
+}
+
+void work_run(Op *head)
+{
+	// split the files into chunks
+	size_t cap = 0;
+
+	for (size_t i = 0; i < inputs.len; i++) {
+		struct stat st;
+		uint64_t size = 0, off = 0;
+
+		if (stat(inputs.path[i], &st) != 0)
+			die("%s: %s\n", inputs.path[i], strerror(errno));
+
+		if (ndjson && (uint64_t)st.st_size > CHUNKSIZE) {
+			if (!S_ISREG(st.st_mode))
+				die("%s: --unordered needs regular files\n", inputs.path[i]);
+			size = st.st_size;
+		}
+
+		do {
+			if (work.nchunks == cap) {
+				cap = cap == 0 ? 64 : cap * 2;
+				work.chunks = xrealloc(work.chunks, cap * sizeof(*work.chunks));
+			}
+			work.chunks[work.nchunks].file = i;
+			work.chunks[work.nchunks].start = off;
+			work.chunks[work.nchunks].end = size > 0 ? off + CHUNKSIZE : 0;
+			work.nchunks++;
+			off += CHUNKSIZE;
+		} while (off < size);
+	}
+
+#ifdef MAP_ANONYMOUS
+	work.shared = mmap(NULL, sizeof(*work.shared), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+#else
+	int fd = open("/dev/zero", O_RDWR);
+	work.shared = mmap(NULL, sizeof(*work.shared), PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	close(fd);
+#endif
+	if (work.shared == MAP_FAILED)
+		die("mmap: %s\n", strerror(errno));
+
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	if (pthread_mutex_init(&work.shared->lock, &attr))
+		die("pthread_mutex_init failed\n");
+	pthread_mutexattr_destroy(&attr);
+
+	// the matcher keeps its state in globals, so the workers are processes
+	size_t n = nthreads < work.nchunks ? nthreads : work.nchunks;
+	fflush(stdout);
+
+	for (size_t i = 0; i < n; i++) {
+		pid_t pid = fork();
+
+		if (pid < 0)
+			die("fork: %s\n", strerror(errno));
+
+		if (pid == 0) {
+			// each worker has an equal share of what is left of the budget
+			if (mem.max > 0)
+				mem.max = mem.used + (mem.max - mem.used) / n;
+
+			work_input(head);
+			exit(0);
+		}
+	}
+
+	int status;
+	bool failed = false;
+
+	while (wait(&status) > 0) {
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed = true;
+	}
+
+	if (failed)
+		exit(1);
+
+	nbad += work.shared->nbad;
+	digest = work.shared->digest;
+}
+
+void work_input(Op *head)
+{
+	size_t cur = SIZE_MAX;
+
+	work.on = true;
+
+	for (;;) {
+		pthread_mutex_lock(&work.shared->lock);
+		size_t k = work.shared->next++;
+		pthread_mutex_unlock(&work.shared->lock);
+
+		if (k >= work.nchunks)
+			break;
+
+		if (work.chunks[k].end == 0) {
+			if (lexer.file)
+				fclose(lexer.file);
+			lexer.file = NULL;
+			cur = SIZE_MAX;
+
+			run_file(head, inputs.path[work.chunks[k].file]);
+			continue;
+		}
+
+		if (work.chunks[k].file != cur) {
+			if (lexer.file)
+				fclose(lexer.file);
+
+			cur = work.chunks[k].file;
+			lexer.name = inputs.path[cur];
+			lexer.file = fopen(lexer.name, "r");
+			if (!lexer.file)
+				die("%s: %s\n", lexer.name, strerror(errno));
+		}
+
+		// a record that begins in the previous chunk is read with it
+		uint64_t start = work.chunks[k].start, end = work.chunks[k].end;
+
+		if (fseeko(lexer.file, start > 0 ? start - 1 : 0, SEEK_SET) != 0)
+			die("%s: %s\n", lexer.name, strerror(errno));
+
+		for (int c; start > 0 && (c = getc(lexer.file)) != EOF && c != '\n'; )
+			start++;
+
+		if (start >= end)
+			continue;
+
+		lexer.start = start;
+		lexer.end = end;
+		run_input(head);
+		lexer.start = lexer.end = 0;
+	}
+
+	work_flush();
+
+	pthread_mutex_lock(&work.shared->lock);
+	work.shared->nbad += nbad;
+	td_merge(&work.shared->digest, &digest);
+	pthread_mutex_unlock(&work.shared->lock);
+}
+
+void work_flush()
+{
+	// the output of a worker is written a block at a time, so that the
+	// rows of its records are not mixed with those of other workers
+	pthread_mutex_lock(&work.shared->lock);
+
+	for (size_t off = 0; off < work.buf.len; ) {
+		ssize_t n = write(STDOUT_FILENO, work.buf.str + off, work.buf.len - off);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			pthread_mutex_unlock(&work.shared->lock);
+			die("write: %s\n", strerror(errno));
+		}
+		off += n;
+	}
+
+	pthread_mutex_unlock(&work.shared->lock);
+	work.buf.len = 0;
+}
+
+void add_input(char *path)
+{
+	struct stat st;
+
+	if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+		if (inputs.len == inputs.cap) {
+			inputs.cap = inputs.cap == 0 ? 64 : inputs.cap * 2;
+			inputs.path = xrealloc(inputs.path, inputs.cap * sizeof(*inputs.path));
+		}
+		inputs.path[inputs.len++] = path;
+		return;
+	}
+
+	DIR *dir = opendir(path);
+	if (!dir)
+		die("%s: %s\n", path, strerror(errno));
+
+	// the entries are read in name order so that the output is the same
+	// on every run; hidden entries are left out, as they are by the shell
+	char **names = NULL;
+	size_t len = 0, cap = 0;
+	struct dirent *e;
+
+	while ((e = readdir(dir))) {
+		if (e->d_name[0] == '.')
+			continue;
+
+		if (len == cap) {
+			cap = cap == 0 ? 16 : cap * 2;
+			names = xrealloc(names, cap * sizeof(*names));
+		}
+
+		size_t n = strlen(path) + strlen(e->d_name) + 2;
+		names[len] = xcalloc(n, 1);
+		snprintf(names[len++], n, "%s/%s", path, e->d_name);
+	}
+
+	closedir(dir);
+	qsort(names, len, sizeof(*names), cmp_name);
+
+	// symbolic links to directories are not followed, which could lead
+	// around in circles, and only regular files are read, as opening a
+	// FIFO or device could block
+	for (size_t i = 0; i < len; i++) {
+		if (lstat(names[i], &st) == 0 && S_ISLNK(st.st_mode) &&
+				stat(names[i], &st) == 0 && S_ISDIR(st.st_mode))
+			continue;
+		if (stat(names[i], &st) == 0 &&
+				!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))
+			continue;
+		add_input(names[i]);
+	}
+
+	xfree(names);
+}
+
+void read_list(const char *path)
+{
+	// the list holds paths terminated by NUL
+	FILE *f = strcmp(path, "-") ? fopen(path, "r") : stdin;
+	if (!f)
+		die("%s: %s\n", path, strerror(errno));
+
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t n;
+
+	while ((n = getdelim(&line, &cap, '\0', f)) > 0) {
+		if (line[n - 1] == '\0')
+			n--;
+		if (n == 0)
+			continue;
+
+		char *p = xcalloc(n + 1, 1);
+		memcpy(p, line, n);
+		add_input(p);
+	}
+
+	if (ferror(f))
+		die("%s: %s\n", path, strerror(errno));
+
+	free(line);
+	if (f != stdin)
+		fclose(f);
+}
+
+int cmp_name(const void *a, const void *b)
+{
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+void run_file(Op *head, char *path)
+{
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0 || fstat(fd, &st) != 0)
+		die("%s: %s\n", path, strerror(errno));
+
+	lexer.name = path;
+
+	// small files are read whole with one read, without stdio; files that
+	// report no size, such as those under /proc, are read until the end
+	if (S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size <= SMALLSIZE) {
+		size_t len = 0, size = st.st_size;
+		ensure_bufcap(&inputs.small, size + 1);
+
+		while (len < size) {
+			ssize_t n = read(fd, inputs.small.str + len, size - len);
+
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0)
+				die("%s: %s\n", path, strerror(errno));
+			if (n == 0)
+				break;
+			len += n;
+		}
+
+		close(fd);
+
+		lexer.file = NULL;
+		lexer.mem = inputs.small.str;
+		lexer.memlen = len;
+		run_input(head);
+		return;
+	}
+
+	lexer.file = fdopen(fd, "r");
+	if (!lexer.file)
+		die("%s: %s\n", path, strerror(errno));
+
+	run_input(head);
+	fclose(lexer.file);
+	lexer.file = NULL;
+}
+
+bool cache_key(int files, Buf *b)
+{
+	// the options and pattern, and the identity of each file read
+	append_str(b, "jl 2", 5);
+
+	for (int i = 1; i < files; i++) {
+		if (i == cache.opt || i == cache.opt + 1)
+			continue;
+		append_str(b, cache.argv[i], strlen(cache.argv[i]) + 1);
+	}
+
+	bool ok = !join.path || add_identity(b, join.path);
+
+	for (size_t i = 0; i < inputs.len && ok; i++)
+		ok = add_identity(b, inputs.path[i]);
+
+	return ok;
+}
+
+bool add_identity(Buf *b, const char *path)
+{
+	struct stat st;
+
+	if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+		return false;
+
+	uint64_t id[] = {
+		st.st_dev, st.st_ino, st.st_size,
+		st.st_mtim.tv_sec, st.st_mtim.tv_nsec,
+	};
+	append_str(b, (char*)id, sizeof(id));
+	return true;
+}
+
+bool cache_open(int files)
+{
+	// standard input cannot be identified, and random samples, offsets and
+	// diagnostics are not part of the output
+	if (inputs.len == 0 || validating || badfile || norm.prefix ||
+			sample.mode == S_BERNOULLI || sample.mode == S_RESERVOIR ||
+			!cache_key(files, &cache.text))
+		return false;
+
+	cache.key = hash_bytes(cache.text.str, cache.text.len);
+
+	size_t len = strlen(cache.dir) + 32;
+	cache.path = xcalloc(len, 1);
+	snprintf(cache.path, len, "%s/%016" PRIx64, cache.dir, cache.key);
+
+	FILE *f = fopen(cache.path, "r");
+
+	if (f && !cache_match(f)) {
+		fclose(f);
+		f = NULL;
+	}
+
+	if (f) {
+		char data[1 << 16];
+		size_t n;
+
+		while ((n = fread(data, 1, sizeof(data), f)) > 0)
+			fwrite(data, 1, n, stdout);
+
+		if (ferror(f))
+			die("%s: %s\n", cache.path, strerror(errno));
+
+		fclose(f);
+		return true;
+	}
+
+	if (mkdir(cache.dir, 0777) != 0 && errno != EEXIST)
+		die("%s: %s\n", cache.dir, strerror(errno));
+
+	cache.tmp = xcalloc(len + 8, 1);
+	snprintf(cache.tmp, len + 8, "%s/.XXXXXX", cache.dir);
+
+	int fd = mkstemp(cache.tmp);
+	if (fd == -1 || !(cache.file = fdopen(fd, "w")))
+		die("%s: %s\n", cache.dir, strerror(errno));
+
+	atexit(cache_discard);
+
+	uint64_t n = cache.text.len;
+	fwrite(&n, sizeof(n), 1, cache.file);
+	fwrite(cache.text.str, 1, cache.text.len, cache.file);
+	return false;
+}
+
+bool cache_match(FILE *f)
+{
+	// a different key with the same hash is a miss
+	uint64_t len;
+
+	if (fread(&len, sizeof(len), 1, f) != 1 || len != cache.text.len)
+		return false;
+
+	char *text = xcalloc(cache.text.len + 1, 1);
+	bool ok = fread(text, 1, cache.text.len, f) == cache.text.len &&
+		!memcmp(text, cache.text.str, cache.text.len);
+
+	xfree(text);
+	return ok;
+}
+
+void cache_finish(int files)
+{
+	// keep only complete output of files that did not change while read
+	Buf b = { 0 };
+
+	if (nbad > 0 || invalid || fclose(cache.file) != 0) {
+		cache.file = NULL;
+		return;
+	}
+
+	cache.file = NULL;
+
+	bool same = cache_key(files, &b) && b.len == cache.text.len &&
+		!memcmp(b.str, cache.text.str, b.len);
+
+	if (same && rename(cache.tmp, cache.path) == 0) {
+		xfree(cache.tmp);
+		cache.tmp = NULL;
+	}
+
+	xfree(b.str);
+}
+
+void cache_discard()
+{
+	if (cache.file)
+		fclose(cache.file);
+
+	if (cache.tmp)
+		unlink(cache.tmp);
+}
+
+Token *next_token()
+{
+	if (lexer.peek) {
+		Token *t = lexer.peek;
+		lexer.peek = NULL;
+		return t;
+	}
+
+	lexer.token.text = NULL;
+	lexer.room = lexer.key ? SIZE_MAX : maxvalue;
+	lexer.key = false;
+
+	if (lexer.text.len > 0) {
+		lexer.text.str[0] = '\0';
+		lexer.text.len = 0;
+	}
+
+	lexer.source->read_token();
+
+	if (!lexer.token.text)
+		lexer.token.text = lexer.text.str ? lexer.text.str : "";
+
+	return &lexer.token;
+}
+
+Token *next_key()
+{
+	if (!lexer.peek)
+		lexer.key = true;
+
+	return next_token();
+}
+
+Token *peek_token()
+{
+	if (!lexer.peek)
+		lexer.peek = next_token();
+
+	return lexer.peek;
 }
 
 void read_token()
 {
-	// Skip whitespace
-	static char ws[] = { ' ', '\t', '\n', '\r' };
-	int c;
-	do {
-		c = read_char();
-	} while (memchr(ws, c, sizeof(ws)));
+	// Skip whitespace, whole runs at a time while they are in the buffer
+	int c;
+	skip_space();
+	do {
+		c = read_char();
+	} while (chars[(unsigned char)c] & C_SPACE);
+
+	Token *t = &lexer.token;
+
+	switch (c) {
+	case '\0':
+		if (!lexer.eof && !lexer.eol)
+			fail("unexpected null character\n");
+		t->type = T_EOF;
+		break;
+	case '{':
+		t->type = T_BEGINOBJECT;
+		t->text = "{";
+		break;
+	case '}':
+		t->type = T_ENDOBJECT;
+		t->text = "}";
+		break;
+	case ':':
+		t->type = T_PAIRSEP;
+		t->text = ":";
+		break;
+	case ',':
+		t->type = T_MEMBERSEP;
+		t->text = ",";
+		break;
+	case '[':
+		t->type = T_BEGINARRAY;
+		t->text = "[";
+		break;
+	case ']':
+		t->type = T_ENDARRAY;
+		t->text = "]";
+		break;
+	case 't':
+		t->type = T_BOOL;
+		read_literal(t, "true", 1);
+		break;
+	case 'f':
+		t->type = T_BOOL;
+		read_literal(t, "false", 1);
+		break;
+	case 'n':
+		t->type = T_NULL;
+		read_literal(t, "null", 1);
+		break;
+	case '"':
+		t->type = T_STRING;
+		after_quote();
+		break;
+	case '-':
+	case '0':
+	case '1':
+	case '2':
+	case '3':
+	case '4':
+	case '5':
+	case '6':
+	case '7':
+	case '8':
+	case '9':
+		t->type = T_NUMBER;
+		read_number(c);
+		break;
+	default:
+		fail("unexpected character: %c\n", c);
+	}
+}
+
+void read_literal(Token *t, char *v, size_t offset)
+{
+	size_t len = strlen(v + offset);
+
+	if (!lexer.eol && lexer.buf.lim - lexer.buf.i >= len &&
+			(trusted || !memcmp(lexer.buf.data + lexer.buf.i, v + offset, len))) {
+		lexer.buf.i += len;
+		t->text = v;
+		return;
+	}
+
+	for (char *p = v + offset; *p != '\0'; p++) {
+		if (read_char() != *p && !trusted)
+			fail("error matching literal: %s\n", v);
+	}
+	t->text = v;
+}
+
+void after_quote()
+{
+	Buf *b = &lexer.text;
+	size_t n = string_run();
+	char *run = lexer.buf.data + lexer.buf.i;
+
+	// a string without escapes that ends in the buffer is used in place
+	if (!lexer.unread && !lexer.eol && n < lexer.buf.lim - lexer.buf.i &&
+			run[n] == '"') {
+		lexer.token.text = run;
+		lexer.buf.i += n + 1;
+
+		if (n > lexer.room) {
+			if (capture.on)
+				patch_buf(run + n);
+			run[n] = '\0';
+
+			n = lexer.room;
+			while (n > 0 && (run[n] & 0xc0) == 0x80)
+				n--;
+		}
+
+		if (capture.on)
+			patch_buf(run + n);
+		run[n] = '\0';
+		return;
+	}
+
+	for (;;) {
+		text_str(run, n);
+		lexer.buf.i += n;
+
+		int c = read_char();
+
+		if (c == '\0') {
+			char *str = b->len > 0 ? b->str : "";
+			fail("non-terminated string: %s\n", str);
+		}
+		else if (c == '"') {
+			// a string that was cut short may end in part of a sequence
+			if (lexer.room == 0)
+				text_trim();
+			break;
+		}
+		else if (c == '\\') {
+			if (decoding) {
+				decode_escape(read_char());
+			}
+			else {
+				text_char('\\');
+				after_slash();
+			}
+		}
+		else if (c >= 0x00 && c <= 0x1f && !trusted) {
+			// the delete character 0x7f is allowed
+			fail("control character in string\n");
+		}
+		else {
+			text_char(c);
+		}
+
+		n = string_run();
+		run = lexer.buf.data + lexer.buf.i;
+	}
+}
+
+size_t string_run()
+{
+	// the length of the run of characters at the cursor that need no
+	// further attention: no quote, backslash or control character
+	if (lexer.unread || lexer.eol)
+		return 0;
+
+	const unsigned char *p = (unsigned char*)lexer.buf.data + lexer.buf.i;
+	size_t len = lexer.buf.lim - lexer.buf.i, i = 0;
+
+	// trusted input is not checked for control characters other than NUL
+	unsigned char maxctrl = trusted ? 0 : 0x1f;
+
+#ifdef __SSE2__
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i slash = _mm_set1_epi8('\\');
+	const __m128i ctrl = _mm_set1_epi8(maxctrl);
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+		__m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, slash));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_min_epu8(v, ctrl), v));
+
+		int mask = _mm_movemask_epi8(m);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+#endif
 
-	Token *t = &lexer.token;
-	Buf *b = &lexer.text;
+	while (i < len && p[i] != '"' && p[i] != '\\' && p[i] > maxctrl)
+		i++;
+
+	return i;
+}
+
+void skip_space()
+{
+	if (lexer.unread || lexer.eol)
+		return;
+
+	for (;;) {
+		lexer.buf.i += space_run();
+
+		if (lexer.buf.i < lexer.buf.lim || !fill_buf())
+			return;
+	}
+}
+
+size_t space_run()
+{
+	// the length of the run of whitespace at the cursor; in NDJSON mode a
+	// newline ends the run as it ends the record
+	const unsigned char *p = (unsigned char*)lexer.buf.data + lexer.buf.i;
+	size_t len = lexer.buf.lim - lexer.buf.i, i = 0;
+#ifdef __SSE2__
+	char nl = ndjson ? ' ' : '\n';
+
+	const __m128i space = _mm_set1_epi8(' ');
+	const __m128i tab = _mm_set1_epi8('\t');
+	const __m128i cr = _mm_set1_epi8('\r');
+	const __m128i newline = _mm_set1_epi8(nl);
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+		__m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, tab));
+		m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, newline)));
+
+		int mask = ~_mm_movemask_epi8(m) & 0xffff;
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+#endif
+
+	while (i < len && chars[p[i]] & C_SPACE && (p[i] != '\n' || !ndjson))
+		i++;
+
+	return i;
+}
+
+void after_slash()
+{
+	int c = read_char();
+
+	static char valid[] = { '"', '\\', '/', 'b', 'f', 'n', 'r', 't' };
+
+	// the digits of a \u escape are then copied as any other character
+	if (trusted) {
+		text_char(c);
+		return;
+	}
+
+	if (memchr(valid, c, sizeof(valid))) {
+		text_char(c);
+	}
+	else if (c == 'u') {
+		text_char('u');
+
+		for (int i = 0; i < 4; i++) {
+			c = read_char();
+
+			if (isxdigit(c))
+				text_char(c);
+			else
+				fail("not a hex character: %c\n", c);
+		}
+	}
+	else {
+		fail("invalid escape character: %c\n", c);
+	}
+}
+
+void decode_escape(int c)
+{
+	long cp;
 
 	switch (c) {
-	case '\0':
-		t->type = T_EOF;
+	case '"':
+	case '\\':
+	case '/':
+		text_char(c);
 		break;
-	case '{':
-		t->type = T_BEGINOBJECT;
-		t->text = "{";
+	case 'b':
+		text_char('\b');
 		break;
-	case '}':
-		t->type = T_ENDOBJECT;
-		t->text = "}";
+	case 'f':
+		text_char('\f');
 		break;
-	case ':':
-		t->type = T_PAIRSEP;
-		t->text = ":";
+	case 'n':
+		text_char('\n');
 		break;
-	case ',':
-		t->type = T_MEMBERSEP;
-		t->text = ",";
+	case 'r':
+		text_char('\r');
 		break;
-	case '[':
-		t->type = T_BEGINARRAY;
-		t->text = "[";
+	case 't':
+		text_char('\t');
 		break;
-	case ']':
-		t->type = T_ENDARRAY;
-		t->text = "]";
+	case 'u':
+		cp = read_hex4();
+
+		// a high surrogate must be followed by an escaped low surrogate,
+		// anything else is decoded on its own
+		if (cp >= 0xd800 && cp <= 0xdbff) {
+			c = read_char();
+			if (c != '\\') {
+				text_utf8(0xfffd);
+				unread_char(c);
+				break;
+			}
+
+			c = read_char();
+			if (c != 'u') {
+				text_utf8(0xfffd);
+				decode_escape(c);
+				break;
+			}
+
+			long lo = read_hex4();
+			if (lo >= 0xdc00 && lo <= 0xdfff) {
+				cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+			}
+			else {
+				text_utf8(0xfffd);
+				cp = lo;
+			}
+		}
+
+		// NUL would end the value, so it stays escaped
+		if (cp == 0)
+			text_str("\\u0000", 6);
+		else
+			text_utf8(cp);
 		break;
-	case 't':
-		t->type = T_BOOL;
-		read_literal(t, "true", 1);
+	default:
+		fail("invalid escape character: %c\n", c);
+	}
+}
+
+long read_hex4()
+{
+	long v = 0;
+
+	for (int i = 0; i < 4; i++) {
+		int c = read_char();
+
+		if (c >= '0' && c <= '9')
+			v = v * 16 + c - '0';
+		else if (c >= 'a' && c <= 'f')
+			v = v * 16 + c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F')
+			v = v * 16 + c - 'A' + 10;
+		else
+			fail("not a hex character: %c\n", c);
+	}
+
+	return v;
+}
+
+void text_utf8(long cp)
+{
+	char u[4];
+	size_t n;
+
+	// unpaired surrogates become the replacement character
+	if (cp >= 0xd800 && cp <= 0xdfff)
+		cp = 0xfffd;
+
+	if (cp < 0x80) {
+		u[0] = cp;
+		n = 1;
+	}
+	else if (cp < 0x800) {
+		u[0] = 0xc0 | cp >> 6;
+		u[1] = 0x80 | (cp & 0x3f);
+		n = 2;
+	}
+	else if (cp < 0x10000) {
+		u[0] = 0xe0 | cp >> 12;
+		u[1] = 0x80 | (cp >> 6 & 0x3f);
+		u[2] = 0x80 | (cp & 0x3f);
+		n = 3;
+	}
+	else {
+		u[0] = 0xf0 | cp >> 18;
+		u[1] = 0x80 | (cp >> 12 & 0x3f);
+		u[2] = 0x80 | (cp >> 6 & 0x3f);
+		u[3] = 0x80 | (cp & 0x3f);
+		n = 4;
+	}
+
+	text_str(u, n);
+}
+
+void read_number(int c)
+{
+	// a number is never cut short, which would change its value
+	lexer.room = SIZE_MAX;
+
+	size_t n = number_run(c);
+
+	if (n > 0) {
+		text_char(c);
+		text_str(lexer.buf.data + lexer.buf.i, n - 1);
+		lexer.buf.i += n - 1;
+		return;
+	}
+
+	text_char(c);
+
+	if (trusted) {
+		while (chars[(unsigned char)(c = read_char())] & C_NUMBER)
+			text_char(c);
+		if (c != '\0')
+			unread_char(c);
+		return;
+	}
+
+	if (c == '-')
+		after_minus();
+	else if (c == '0')
+		after_0();
+	else
+		after_1to9();
+}
+
+size_t number_run(int c)
+{
+	// the length of the number that starts with c, followed by the rest of
+	// it at the cursor, or 0 if it may go on past the buffer and has to be
+	// read a character at a time
+	if (lexer.eol)
+		return 0;
+
+	const char *start = lexer.buf.data + lexer.buf.i, *end = lexer.buf.data + lexer.buf.lim;
+	const char *p = start;
+
+	while (p < end && chars[(unsigned char)*p] & C_NUMBER)
+		p++;
+
+	if (p == end)
+		return 0;
+
+	if (trusted)
+		return p - start + 1;
+
+	// the run is followed by a character that ends it, so the checks
+	// below cannot read past the buffer
+	p = start;
+
+	if (c == '-') {
+		if (!(chars[(unsigned char)*p] & C_DIGIT))
+			number_fail(p, "no digit following minus sign\n");
+		c = *p++;
+	}
+
+	if (c != '0') {
+		while (chars[(unsigned char)*p] & C_DIGIT)
+			p++;
+	}
+
+	if (*p == '.') {
+		const char *digits = ++p;
+		while (chars[(unsigned char)*p] & C_DIGIT)
+			p++;
+		if (p == digits)
+			number_fail(p, "no digits after fraction\n");
+	}
+
+	if (*p == 'e' || *p == 'E') {
+		p++;
+		if (*p == '+' || *p == '-')
+			p++;
+
+		const char *digits = p;
+		while (chars[(unsigned char)*p] & C_DIGIT)
+			p++;
+		if (p == digits)
+			number_fail(p, "no exponent digits\n");
+	}
+
+	return p - start + 1;
+}
+
+void number_fail(const char *p, const char *msg)
+{
+	// report the error at the offending character, as if it had been read
+	lexer.buf.i = p - lexer.buf.data;
+	read_char();
+	fail("%s", msg);
+}
+
+void after_minus()
+{
+	int c = read_char();
+
+	switch (c) {
+	case '0':
+		text_char(c);
+		after_0();
 		break;
-	case 'f':
-		t->type = T_BOOL;
-		read_literal(t, "false", 1);
+	case '1':
+	case '2':
+	case '3':
+	case '4':
+	case '5':
+	case '6':
+	case '7':
+	case '8':
+	case '9':
+		text_char(c);
+		after_1to9();
 		break;
-	case 'n':
-		t->type = T_NULL;
-		read_literal(t, "null", 1);
+	default:
+		fail("no digit following minus sign\n");
+	}
+}
+
+void after_0()
+{
+	int c = read_char();
+
+	if (c == '.') {
+		text_char('.');
+		after_frac();
+	}
+	else if (c == 'e' || c == 'E') {
+		text_char(c);
+		after_exp();
+	}
+	else if (c != '\0') {
+		unread_char(c);
+	}
+}
+
+void after_1to9()
+{
+	for (;;) {
+		int c = read_char();
+
+		switch (c) {
+		case '\0':
+			return;
+		case '.':
+			text_char(c);
+			after_frac();
+			return;
+		case '0':
+		case '1':
+		case '2':
+		case '3':
+		case '4':
+		case '5':
+		case '6':
+		case '7':
+		case '8':
+		case '9':
+			text_char(c);
+			break;
+		case 'e':
+		case 'E':
+			text_char(c);
+			after_exp();
+			return;
+		default:
+			unread_char(c);
+			return;
+		}
+	}
+}
+
+void after_frac()
+{
+	if (append_digits() < 1)
+		fail("no digits after fraction\n");
+
+	int c = read_char();
+
+	switch (c) {
+	case '\0':
 		break;
-	case '"':
-		t->type = T_STRING;
-		after_quote();
+	case 'e':
+	case 'E':
+		text_char(c);
+		after_exp();
 		break;
+	default:
+		unread_char(c);
+	}
+}
+
+void after_exp()
+{
+	int c = read_char();
+
+	switch (c) {
+	case '\0':
+		fail("no exponent digits\n");
+	case '+':
 	case '-':
-		t->type = T_NUMBER;
-		append_char(b, c);
-		after_minus();
+		text_char(c);
+
+		if (append_digits() == 0)
+			fail("no exponent digits\n");
 		break;
 	case '0':
-		t->type = T_NUMBER;
-		append_char(b, c);
-		after_0();
-		break;
 	case '1':
 	case '2':
 	case '3':
@@ -624,266 +3980,912 @@ void read_token()
 	case '7':
 	case '8':
 	case '9':
-		t->type = T_NUMBER;
-		append_char(b, c);
-		after_1to9();
+		text_char(c);
+		append_digits();
 		break;
 	default:
-		die("unexpected character: %c\n", c);
+		fail("no exponent digits\n");
 	}
 }
 
-void read_literal(Token *t, char *v, size_t offset)
+int append_digits()
 {
-	for (char *p = v + offset; *p != '\0'; p++) {
-		if (read_char() != *p)
-			die("error matching literal: %s\n", v);
+	for (int n = 0; ; n++) {
+		int c = read_char();
+
+		switch (c) {
+		case '\0':
+			return n;
+		case '0':
+		case '1':
+		case '2':
+		case '3':
+		case '4':
+		case '5':
+		case '6':
+		case '7':
+		case '8':
+		case '9':
+			text_char(c);
+			break;
+		default:
+			unread_char(c);
+			return n;
+		}
 	}
-	t->text = v;
 }
 
-void after_quote()
+void bin_read_token()
 {
-	Buf *b = &lexer.text;
+	Token *t = &lexer.token;
+	Frame *f = lexer.frames.len ? &lexer.frames.f[lexer.frames.len - 1] : NULL;
+
+	// after an item comes a separator or the end of the container
+	if (f && (f->fresh || f->after)) {
+		bool fresh = f->fresh;
+		f->fresh = f->after = false;
+
+		if (bin_frame_done(f)) {
+			t->type = f->map ? T_ENDOBJECT : T_ENDARRAY;
+			t->text = f->map ? "}" : "]";
+			lexer.frames.len--;
+			bin_item_done();
+			return;
+		}
+
+		if (!fresh) {
+			t->type = f->map && f->items % 2 ? T_PAIRSEP : T_MEMBERSEP;
+			t->text = t->type == T_PAIRSEP ? ":" : ",";
+			return;
+		}
+	}
+
+	Head h;
+
+	if (!lexer.source->read_head(&h)) {
+		if (f)
+			fail("unexpected end of input\n");
+		t->type = T_EOF;
+		return;
+	}
+
+	bool key = f && f->map && f->items % 2 == 0;
+
+	switch (h.kind) {
+	case V_ARRAY:
+	case V_MAP:
+		if (key)
+			fail("unsupported map key\n");
+		t->type = h.kind == V_MAP ? T_BEGINOBJECT : T_BEGINARRAY;
+		t->text = h.kind == V_MAP ? "{" : "[";
+		bin_push(h.kind == V_MAP, &h);
+		return;
+	case V_BREAK:
+		fail("unexpected break\n");
+		break;
+	case V_BOOL:
+		t->type = T_BOOL;
+		t->text = h.n ? "true" : "false";
+		break;
+	case V_NULL:
+		t->type = T_NULL;
+		t->text = "null";
+		break;
+	case V_BYTES:
+	case V_TEXT:
+		t->type = T_STRING;
+		bin_text(&h);
+		break;
+	default:
+		t->type = T_NUMBER;
+		bin_number(&h);
+
+		// the matcher only knows string keys
+		if (key)
+			t->type = T_STRING;
+		else if (!lexer.text.len)
+			t->type = T_NULL, t->text = "null";
+		break;
+	}
+
+	if (key && t->type != T_STRING)
+		fail("unsupported map key\n");
+
+	bin_item_done();
+}
+
+bool bin_skip(bool started)
+{
+	Frame *f = lexer.frames.len ? &lexer.frames.f[lexer.frames.len - 1] : NULL;
+
+	// skip the rest of the container that was just started
+	if (started) {
+		Head h;
+
+		while (!bin_frame_done(f)) {
+			if (!lexer.source->read_head(&h))
+				fail("unexpected end of input\n");
+			bin_skip_item(&h);
+			f->left--;
+		}
+
+		lexer.frames.len--;
+		bin_item_done();
+		return true;
+	}
+
+	// the next token is a separator, which has to be read first
+	if (f && (f->fresh || f->after))
+		return false;
+
+	Head h;
+
+	if (!lexer.source->read_head(&h))
+		fail("unexpected end of input\n");
+
+	bin_skip_item(&h);
+	bin_item_done();
+	return true;
+}
+
+void bin_push(bool map, Head *h)
+{
+	if (lexer.frames.len == lexer.frames.cap) {
+		lexer.frames.cap = lexer.frames.cap == 0 ? 16 : lexer.frames.cap * 2;
+		lexer.frames.f = xrealloc(lexer.frames.f,
+				lexer.frames.cap * sizeof(*lexer.frames.f));
+	}
+
+	Frame *f = &lexer.frames.f[lexer.frames.len++];
+	f->map = map;
+	f->indefinite = h->indefinite;
+	f->fresh = true;
+	f->after = false;
+	f->left = map ? 2 * h->n : h->n;
+	f->items = 0;
+}
+
+void bin_item_done()
+{
+	if (lexer.frames.len > 0) {
+		Frame *f = &lexer.frames.f[lexer.frames.len - 1];
+		f->items++;
+		f->left--;
+		f->after = true;
+	}
+}
+
+bool bin_frame_done(Frame *f)
+{
+	if (!f->indefinite)
+		return f->left == 0;
+
+	if (peek_byte() != 0xff)
+		return false;
+
+	read_byte();
+	return true;
+}
+
+void bin_skip_item(Head *h)
+{
+	Head item;
+
+	switch (h->kind) {
+	case V_BYTES:
+	case V_TEXT:
+		if (!h->indefinite) {
+			skip_bytes(h->n);
+			break;
+		}
+		// fall through
+	case V_ARRAY:
+	case V_MAP:
+		if (h->indefinite) {
+			while (peek_byte() != 0xff) {
+				if (!lexer.source->read_head(&item))
+					fail("unexpected end of input\n");
+				bin_skip_item(&item);
+			}
+			read_byte();
+		}
+		else {
+			for (uint64_t n = h->kind == V_MAP ? 2 * h->n : h->n; n > 0; n--) {
+				if (!lexer.source->read_head(&item))
+					fail("unexpected end of input\n");
+				bin_skip_item(&item);
+			}
+		}
+		break;
+	case V_BREAK:
+		fail("unexpected break\n");
+		break;
+	default:
+		break;
+	}
+}
+
+void bin_text(Head *h)
+{
+	Head chunk = *h;
+
+	// indefinite strings are a sequence of definite chunks
+	if (h->indefinite) {
+		if (peek_byte() == 0xff) {
+			read_byte();
+			return;
+		}
+		if (!lexer.source->read_head(&chunk) || chunk.kind != h->kind || chunk.indefinite)
+			fail("invalid string chunk\n");
+	}
 
 	for (;;) {
-		int c = read_char();
+		uint64_t n = chunk.n;
 
-		if (c == '\0') {
-			char *str = b->len > 0 ? b->str : "";
-			die("non-terminated string: %s\n", str);
+		while (n > 0) {
+			while (lexer.buf.i >= lexer.buf.len) {
+				if (!fill_buf())
+					fail("unexpected end of input\n");
+			}
+
+			size_t len = lexer.buf.len - lexer.buf.i;
+			if (len > n)
+				len = n;
+
+			char *p = lexer.buf.data + lexer.buf.i;
+
+			if (h->kind == V_BYTES)
+				text_hex(p, len);
+			else if (decoding)
+				text_str(p, len);
+			else
+				text_escaped(p, len);
+
+			lexer.buf.i += len;
+			n -= len;
 		}
-		else if (c == '"') {
+
+		if (!h->indefinite)
+			break;
+
+		if (peek_byte() == 0xff) {
+			read_byte();
 			break;
 		}
-		else if (c == '\\') {
-			append_char(b, '\\');
-			after_slash();
+
+		if (!lexer.source->read_head(&chunk) || chunk.kind != h->kind || chunk.indefinite)
+			fail("invalid string chunk\n");
+	}
+}
+
+void bin_number(Head *h)
+{
+	char num[32];
+
+	lexer.room = SIZE_MAX;
+
+	switch (h->kind) {
+	case V_UINT:
+		snprintf(num, sizeof(num), "%" PRIu64, h->n);
+		break;
+	case V_NEGINT:
+		// -1 - n does not always fit in an int64_t
+		if (h->n == UINT64_MAX)
+			snprintf(num, sizeof(num), "-18446744073709551616");
+		else
+			snprintf(num, sizeof(num), "-%" PRIu64, h->n + 1);
+		break;
+	case V_INT:
+		snprintf(num, sizeof(num), "%" PRId64, h->i);
+		break;
+	default:
+		// JSON has no infinities or NaN, which leave the text empty
+		if (h->d - h->d != 0)
+			return;
+
+		// use the shortest representation that reads back the same
+		for (int prec = 15; prec <= 17; prec++) {
+			snprintf(num, sizeof(num), "%.*g", prec, h->d);
+			if (strtod(num, NULL) == h->d)
+				break;
 		}
-		else if (c >= 0x00 && c <= 0x1f) {
-			// the delete character 0x7f is allowed
-			die("control character in string\n");
+		break;
+	}
+
+	text_str(num, strlen(num));
+}
+
+bool cbor_head(Head *h)
+{
+	int c = read_byte();
+
+	if (c == -1)
+		return false;
+
+	int major = c >> 5, ai = c & 0x1f;
+
+	memset(h, 0, sizeof(*h));
+
+	if (ai < 24)
+		h->n = ai;
+	else if (ai <= 27)
+		h->n = read_be(1 << (ai - 24));
+	else if (ai == 31 && (major >= 2 && major <= 5))
+		h->indefinite = true;
+	else if (c == 0xff)
+		return h->kind = V_BREAK, true;
+	else
+		fail("invalid CBOR item: 0x%02x\n", c);
+
+	switch (major) {
+	case 0:
+		h->kind = V_UINT;
+		break;
+	case 1:
+		h->kind = V_NEGINT;
+		break;
+	case 2:
+		h->kind = V_BYTES;
+		break;
+	case 3:
+		h->kind = V_TEXT;
+		break;
+	case 4:
+		h->kind = V_ARRAY;
+		break;
+	case 5:
+		h->kind = V_MAP;
+		break;
+	case 6:
+		// tags only annotate the item that follows
+		if (!cbor_head(h))
+			fail("unexpected end of input\n");
+		break;
+	default:
+		if (ai == 20 || ai == 21) {
+			h->kind = V_BOOL;
+			h->n = ai == 21;
+		}
+		else if (ai == 25) {
+			// half precision, converted by way of single precision
+			uint32_t sign = (h->n & 0x8000) << 16, e = h->n >> 10 & 0x1f;
+			uint32_t m = h->n & 0x3ff, bits;
+			float f;
+
+			if (e == 0) {
+				h->d = m / 16777216.0;
+				h->d = sign ? -h->d : h->d;
+			}
+			else {
+				bits = sign | (e == 31 ? 0xff : e - 15 + 127) << 23 | m << 13;
+				memcpy(&f, &bits, sizeof(f));
+				h->d = f;
+			}
+			h->kind = V_FLOAT;
+		}
+		else if (ai == 26) {
+			uint32_t bits = h->n;
+			float f;
+			memcpy(&f, &bits, sizeof(f));
+			h->d = f;
+			h->kind = V_FLOAT;
+		}
+		else if (ai == 27) {
+			memcpy(&h->d, &h->n, sizeof(h->d));
+			h->kind = V_FLOAT;
 		}
 		else {
-			append_char(b, c);
+			// null, undefined and unassigned simple values
+			h->kind = V_NULL;
+		}
+		break;
+	}
+
+	return true;
+}
+
+bool msgpack_head(Head *h)
+{
+	int c = read_byte();
+
+	if (c == -1)
+		return false;
+
+	memset(h, 0, sizeof(*h));
+
+	if (c <= 0x7f) {
+		h->kind = V_UINT;
+		h->n = c;
+	}
+	else if (c <= 0x8f) {
+		h->kind = V_MAP;
+		h->n = c & 0x0f;
+	}
+	else if (c <= 0x9f) {
+		h->kind = V_ARRAY;
+		h->n = c & 0x0f;
+	}
+	else if (c <= 0xbf) {
+		h->kind = V_TEXT;
+		h->n = c & 0x1f;
+	}
+	else if (c >= 0xe0) {
+		h->kind = V_INT;
+		h->i = c - 0x100;
+	}
+	else {
+		switch (c) {
+		case 0xc0:
+			h->kind = V_NULL;
+			break;
+		case 0xc2:
+		case 0xc3:
+			h->kind = V_BOOL;
+			h->n = c == 0xc3;
+			break;
+		case 0xc4:
+		case 0xc5:
+		case 0xc6:
+			h->kind = V_BYTES;
+			h->n = read_be(1 << (c - 0xc4));
+			break;
+		case 0xc7:
+		case 0xc8:
+		case 0xc9:
+			// extensions are kept as bytes, without their type
+			h->kind = V_BYTES;
+			h->n = read_be(1 << (c - 0xc7));
+			read_byte();
+			break;
+		case 0xca: {
+			uint32_t bits = read_be(4);
+			float f;
+			memcpy(&f, &bits, sizeof(f));
+			h->kind = V_FLOAT;
+			h->d = f;
+			break;
+		}
+		case 0xcb: {
+			uint64_t bits = read_be(8);
+			memcpy(&h->d, &bits, sizeof(h->d));
+			h->kind = V_FLOAT;
+			break;
+		}
+		case 0xcc:
+		case 0xcd:
+		case 0xce:
+		case 0xcf:
+			h->kind = V_UINT;
+			h->n = read_be(1 << (c - 0xcc));
+			break;
+		case 0xd0:
+		case 0xd1:
+		case 0xd2:
+		case 0xd3: {
+			// sign-extend from the width of the value
+			int bits = 8 << (c - 0xd0);
+			uint64_t v = read_be(1 << (c - 0xd0));
+			uint64_t m = UINT64_C(1) << (bits - 1);
+			h->kind = V_INT;
+			h->i = bits == 64 ? (int64_t)v : (int64_t)((v ^ m) - m);
+			break;
+		}
+		case 0xd4:
+		case 0xd5:
+		case 0xd6:
+		case 0xd7:
+		case 0xd8:
+			h->kind = V_BYTES;
+			h->n = 1 << (c - 0xd4);
+			read_byte();
+			break;
+		case 0xd9:
+		case 0xda:
+		case 0xdb:
+			h->kind = V_TEXT;
+			h->n = read_be(1 << (c - 0xd9));
+			break;
+		case 0xdc:
+		case 0xdd:
+			h->kind = V_ARRAY;
+			h->n = read_be(2 << (c - 0xdc));
+			break;
+		case 0xde:
+		case 0xdf:
+			h->kind = V_MAP;
+			h->n = read_be(2 << (c - 0xde));
+			break;
+		default:
+			fail("invalid MessagePack item: 0x%02x\n", c);
 		}
 	}
+
+	return true;
+}
+
+uint64_t read_be(int n)
+{
+	uint64_t v = 0;
+
+	for (int i = 0; i < n; i++) {
+		int c = read_byte();
+		if (c == -1)
+			fail("unexpected end of input\n");
+		v = v << 8 | c;
+	}
+
+	return v;
+}
+
+int read_byte()
+{
+	while (lexer.buf.i >= lexer.buf.len) {
+		if (!fill_buf())
+			return -1;
+	}
+
+	return (unsigned char)lexer.buf.data[lexer.buf.i++];
+}
+
+int peek_byte()
+{
+	int c = read_byte();
+
+	if (c != -1)
+		lexer.buf.i--;
+
+	return c;
+}
+
+void skip_bytes(uint64_t n)
+{
+	size_t avail = lexer.buf.len - lexer.buf.i;
+
+	if (n <= avail) {
+		lexer.buf.i += n;
+		return;
+	}
+
+	n -= avail;
+	lexer.buf.i = lexer.buf.len;
+
+	// seek past long values when the input allows it
+	if (n > BUFSIZ && lexer.file && fseeko(lexer.file, n, SEEK_CUR) == 0) {
+		lexer.buf.pos += lexer.buf.len + n;
+		lexer.buf.i = lexer.buf.lim = lexer.buf.len = 0;
+		return;
+	}
+
+	while (n > 0) {
+		if (!fill_buf())
+			fail("unexpected end of input\n");
+
+		avail = lexer.buf.len < n ? lexer.buf.len : n;
+		lexer.buf.i = avail;
+		n -= avail;
+	}
+}
+
+void text_escaped(const char *s, size_t len)
+{
+	static Buf esc;
+
+	esc.len = 0;
+	append_escaped(&esc, s, len);
+	text_str(esc.str, esc.len);
+}
+
+void append_escaped(Buf *b, const char *s, size_t len)
+{
+	// write the string the way it would appear in JSON
+	size_t start = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = s[i];
+		char esc[8];
+
+		if (c == '"' || c == '\\')
+			snprintf(esc, sizeof(esc), "\\%c", c);
+		else if (c == '\n')
+			strcpy(esc, "\\n");
+		else if (c == '\t')
+			strcpy(esc, "\\t");
+		else if (c == '\r')
+			strcpy(esc, "\\r");
+		else if (c < 0x20)
+			snprintf(esc, sizeof(esc), "\\u%04x", c);
+		else
+			continue;
+
+		append_str(b, s + start, i - start);
+		append_str(b, esc, strlen(esc));
+		start = i + 1;
+	}
+
+	append_str(b, s + start, len - start);
+}
+
+void append_name(Buf *b, const char *s)
+{
+	// names and values from the command line are matched against the text
+	// as written in JSON, which is only unescaped with --decode
+	if (decoding)
+		append_escaped(b, s, strlen(s));
+	else
+		append_str(b, s, strlen(s));
 }
 
-void after_slash()
+void text_hex(const char *s, size_t len)
 {
-	int c = read_char();
-	Buf *b = &lexer.text;
+	static const char digits[] = "0123456789abcdef";
 
-	static char valid[] = { '"', '\\', '/', 'b', 'f', 'n', 'r', 't' };
+	for (size_t i = 0; i < len; i++) {
+		text_char(digits[(unsigned char)s[i] >> 4]);
+		text_char(digits[s[i] & 0x0f]);
+	}
+}
 
-	if (memchr(valid, c, sizeof(valid))) {
-		append_char(b, c);
+int read_char()
+{
+	if (lexer.unread) {
+		int c = lexer.unread;
+		lexer.unread = '\0';
+		return c;
 	}
-	else if (c == 'u') {
-		append_char(b, 'u');
 
-		for (int i = 0; i < 4; i++) {
-			c = read_char();
+	// in NDJSON mode the end of a line ends the input until the next line
+	// is started
+	if (lexer.eol)
+		return '\0';
 
-			if (isxdigit(c))
-				append_char(b, c);
-			else
-				die("not a hex character: %c\n", c);
-		}
+	while (lexer.buf.i >= lexer.buf.lim) {
+		if (!fill_buf())
+			return '\0';
 	}
-	else {
-		die("invalid escape character: %c\n", c);
-	}
-}
 
-void after_minus()
-{
-	int c = read_char();
+	char c = lexer.buf.data[lexer.buf.i++];
 
-	switch (c) {
-	case '0':
-		append_char(&lexer.text, c);
-		after_0();
-		break;
-	case '1':
-	case '2':
-	case '3':
-	case '4':
-	case '5':
-	case '6':
-	case '7':
-	case '8':
-	case '9':
-		append_char(&lexer.text, c);
-		after_1to9();
-		break;
-	default:
-		die("no digit following minus sign\n");
+	if (c == '\n' && ndjson) {
+		lexer.eol = true;
+		return '\0';
 	}
+
+	return c;
 }
 
-void after_0()
+bool fill_buf()
 {
-	int c = read_char();
+	if (lexer.buf.i < lexer.buf.len)
+		utf8_fail(lexer.buf.i, "invalid UTF-8\n");
 
-	if (c == '.') {
-		append_char(&lexer.text, '.');
-		after_frac();
+	if (capture.on)
+		capture_save();
+
+	size_t size = BUFSIZ;
+	lexer.buf.pos += lexer.buf.len;
+
+	// input in memory is taken whole, and then ends
+	if (!lexer.file) {
+		lexer.buf.len = size = lexer.memlen;
+		if (lexer.mem)
+			lexer.buf.data = lexer.mem;
+		else
+			lexer.buf.len = 0;
+		lexer.mem = NULL;
 	}
-	else if (c == 'e' || c == 'E') {
-		append_char(&lexer.text, c);
-		after_exp();
+	else {
+		lexer.buf.len = fread(lexer.buf.data, 1, size, lexer.file);
 	}
-	else if (c != '\0') {
-		unread_char(c);
+
+	lexer.buf.i = lexer.buf.lim = 0;
+
+	if (lexer.dropping && (lexer.buf.pos - lexer.dropped >= DROPSTEP ||
+			lexer.buf.len == 0)) {
+		posix_fadvise(fileno(lexer.file), lexer.dropped,
+				lexer.buf.pos - lexer.dropped, POSIX_FADV_DONTNEED);
+		lexer.dropped = lexer.buf.pos;
 	}
-}
 
-void after_1to9()
-{
-	for (;;) {
-		int c = read_char();
+	if (lexer.buf.len < size || lexer.buf.len == 0) {
+		if (lexer.file && ferror(lexer.file))
+			die("read: %s\n", strerror(errno));
 
-		switch (c) {
-		case '\0':
-			return;
-		case '.':
-			append_char(&lexer.text, c);
-			after_frac();
-			return;
-		case '0':
-		case '1':
-		case '2':
-		case '3':
-		case '4':
-		case '5':
-		case '6':
-		case '7':
-		case '8':
-		case '9':
-			append_char(&lexer.text, c);
-			break;
-		case 'e':
-		case 'E':
-			append_char(&lexer.text, c);
-			after_exp();
-			return;
-		default:
-			unread_char(c);
-			return;
+		if (lexer.buf.len == 0) {
+			lexer.eof = true;
+
+			if (lexer.utf8.need > 0)
+				utf8_fail(0, "truncated UTF-8 sequence\n");
+			return false;
 		}
 	}
+
+	lexer.eof = false;
+
+	if (checkutf8)
+		lexer.buf.lim = check_utf8((unsigned char*)lexer.buf.data,
+				lexer.buf.len, &lexer.utf8);
+	else
+		lexer.buf.lim = lexer.buf.len;
+
+	return true;
 }
 
-void after_frac()
+void utf8_fail(size_t i, const char *msg)
 {
-	if (append_digits() < 1)
-		die("no digits after fraction\n");
+	// the sequence is cut short at i: a byte that cannot start one is
+	// skipped, any other starts over, so that an ASCII byte such as the
+	// newline ending an NDJSON record is still read. The error is reported
+	// at the lead byte.
+	const unsigned char *data = (const unsigned char*)lexer.buf.data;
+	uint64_t lead = lexer.buf.pos + i - lexer.utf8.have;
+
+	if (lexer.utf8.need == 0)
+		i++;
+
+	lexer.utf8.need = lexer.utf8.have = 0;
+	lexer.buf.i = i;
+	lexer.buf.lim = i + check_utf8(data + i, lexer.buf.len - i, &lexer.utf8);
+
+	snprintf(lexer.error, sizeof(lexer.error), "%s", msg);
+	fail_at(lead);
+}
 
-	int c = read_char();
+size_t check_utf8(const unsigned char *s, size_t len, Utf8 *u)
+{
+	size_t i = 0;
+
+	while (i < len) {
+		if (u->need == 0) {
+			// skip blocks of ASCII
+#ifdef __SSE2__
+			while (i + 16 <= len &&
+					!_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(s + i))))
+				i += 16;
+#endif
+			if (i == len)
+				break;
 
-	switch (c) {
-	case '\0':
-		break;
-	case 'e':
-	case 'E':
-		append_char(&lexer.text, c);
-		after_exp();
-		break;
-	default:
-		unread_char(c);
+			unsigned char c = s[i];
+
+			u->lo = 0x80;
+			u->hi = 0xbf;
+			u->have = 1;
+
+			if (c >= 0xc2 && c <= 0xdf) {
+				u->need = 1;
+			}
+			else if (c >= 0xe0 && c <= 0xef) {
+				u->need = 2;
+				if (c == 0xe0)
+					u->lo = 0xa0;	// overlong
+				else if (c == 0xed)
+					u->hi = 0x9f;	// surrogates
+			}
+			else if (c >= 0xf0 && c <= 0xf4) {
+				u->need = 3;
+				if (c == 0xf0)
+					u->lo = 0x90;	// overlong
+				else if (c == 0xf4)
+					u->hi = 0x8f;	// above U+10FFFF
+			}
+			else if (c >= 0x80) {
+				u->have = 0;
+				return i;
+			}
+			else {
+				u->have = 0;
+			}
+		}
+		else {
+			if (s[i] < u->lo || s[i] > u->hi)
+				return i;
+
+			u->need--;
+			u->lo = 0x80;
+			u->hi = 0xbf;
+			u->have = u->need > 0 ? u->have + 1 : 0;
+		}
+
+		i++;
 	}
+
+	return len;
 }
 
-void after_exp()
+void unread_char(int c)
 {
-	int c = read_char();
-
-	switch (c) {
-	case '\0':
-		die("no exponent digits\n");
-	case '+':
-	case '-':
-		append_char(&lexer.text, c);
+	lexer.unread = c;
+}
 
-		if (append_digits() == 0)
-			die("no exponent digits\n");
-		break;
-	case '0':
-	case '1':
-	case '2':
-	case '3':
-	case '4':
-	case '5':
-	case '6':
-	case '7':
-	case '8':
-	case '9':
+void text_char(char c)
+{
+	if (lexer.room > 0) {
+		lexer.room--;
 		append_char(&lexer.text, c);
-		append_digits();
-		break;
-	default:
-		die("no exponent digits\n");
 	}
 }
 
-int append_digits()
+void text_str(const char *s, size_t len)
 {
-	for (int n = 0; ; n++) {
-		int c = read_char();
-
-		switch (c) {
-		case '\0':
-			return n;
-		case '0':
-		case '1':
-		case '2':
-		case '3':
-		case '4':
-		case '5':
-		case '6':
-		case '7':
-		case '8':
-		case '9':
-			append_char(&lexer.text, c);
-			break;
-		default:
-			unread_char(c);
-			return n;
-		}
+	// drop what does not fit, without splitting a UTF-8 sequence
+	if (len > lexer.room) {
+		len = lexer.room;
+		while (len > 0 && (s[len] & 0xc0) == 0x80)
+			len--;
+		lexer.room = 0;
+	}
+	else {
+		lexer.room -= len;
 	}
+
+	append_str(&lexer.text, s, len);
 }
 
-int read_char()
+void text_trim()
 {
-	if (lexer.unread) {
-		int c = lexer.unread;
-		lexer.unread = '\0';
-		return c;
-	}
+	Buf *b = &lexer.text;
+	unsigned char *s = (unsigned char*)b->str;
+	size_t len = b->len;
 
-	if (lexer.buf.i >= lexer.buf.len) {
-		size_t size = sizeof(lexer.buf.data);
-		lexer.buf.len = fread(lexer.buf.data, 1, size, lexer.file);
+	// drop an escape sequence that was not copied in full, found by the
+	// last backslash that is not itself escaped
+	for (size_t j = len; !decoding && j-- > 0 && len - j <= 6; ) {
+		if (s[j] != '\\')
+			continue;
 
-		if (lexer.buf.len < size) {
-			if (ferror(lexer.file))
-				die("read: %s\n", strerror(errno));
+		size_t k = j;
+		while (k > 0 && s[k - 1] == '\\')
+			k--;
 
-			if (lexer.buf.len == 0)
-				return '\0';
-		}
+		if ((j - k) % 2 == 0 && (len - j < 2 || (s[j + 1] == 'u' && len - j < 6)))
+			len = j;
+		break;
+	}
 
-		lexer.buf.i = 0;
+	// and a UTF-8 sequence that was not
+	size_t i = len;
+	while (i > 0 && len - i < 4 && (s[i - 1] & 0xc0) == 0x80)
+		i--;
+
+	if (i > 0 && s[i - 1] >= 0xc0) {
+		size_t need = s[i - 1] >= 0xf0 ? 4 : s[i - 1] >= 0xe0 ? 3 : 2;
+		if (len - i + 1 < need)
+			len = i - 1;
 	}
 
-	return lexer.buf.data[lexer.buf.i++];
+	if (len < b->len) {
+		b->len = len;
+		b->str[len] = '\0';
+	}
 }
 
-void unread_char(int c)
+size_t parse_size(const char *s)
 {
-	lexer.unread = c;
+	char *end;
+	unsigned long long n = strtoull(s, &end, 10);
+
+	switch (*end) {
+	case 'k':
+	case 'K':
+		n <<= 10;
+		end++;
+		break;
+	case 'm':
+	case 'M':
+		n <<= 20;
+		end++;
+		break;
+	case 'g':
+	case 'G':
+		n <<= 30;
+		end++;
+		break;
+	}
+
+	if (end == s || *end != '\0')
+		die("invalid size: %s\n", s);
+
+	return n;
 }
 
 void append_char(Buf *b, char c)
@@ -893,6 +4895,14 @@ void append_char(Buf *b, char c)
 	b->str[b->len] = '\0';
 }
 
+void append_str(Buf *b, const char *s, size_t len)
+{
+	ensure_bufcap(b, b->len + len + 1);
+	memcpy(b->str + b->len, s, len);
+	b->len += len;
+	b->str[b->len] = '\0';
+}
+
 void ensure_bufcap(Buf *b, size_t cap)
 {
 	if (b->cap < cap) {
@@ -944,7 +4954,7 @@ void run_array_op(ArrayOp *op)
 			} while (t->type == T_MEMBERSEP);
 
 			if (t->type != T_ENDARRAY)
-				die("expected array end\n");
+				fail("expected array end\n");
 
 			if (op->op.table)
 				add_row(op->op.table);
@@ -968,15 +4978,14 @@ void run_object_op(ObjectOp *op)
 	}
 
 	accept(T_BEGINOBJECT);
+	run_members(op, next_key());
+}
 
-	t = next_token();
-
+void run_members(ObjectOp *op, Token *t)
+{
+	// match the members from the key t on, up to the end of the object
 	while (t->type == T_STRING) {
-		Prop *p = NULL;
-		for (p = op->prop; p; p = p->next) {
-			if (strcmp(p->name, t->text) == 0)
-				break;
-		}
+		Prop *p = find_prop(op, t->text);
 
 		accept(T_PAIRSEP);
 
@@ -990,11 +4999,11 @@ void run_object_op(ObjectOp *op)
 		if (t->type != T_MEMBERSEP)
 			break;
 
-		t = next_token();
+		t = next_key();
 	}
 
 	if (t->type != T_ENDOBJECT)
-		die("expected object end\n");
+		fail("expected object end\n");
 
 	if (op->op.table)
 		add_row(op->op.table);
@@ -1003,6 +5012,18 @@ void run_object_op(ObjectOp *op)
 		flush_tables();
 }
 
+Prop *find_prop(ObjectOp *op, const char *name)
+{
+	for (Prop *p = op->prop; p; p = p->next) {
+		for (Prop *a = p; a; a = a->alt) {
+			if (!strcmp(a->name, name))
+				return p;
+		}
+	}
+
+	return NULL;
+}
+
 void run_collect_op(CollectOp *op)
 {
 	Token *t = peek_token();
@@ -1016,9 +5037,13 @@ void run_collect_op(CollectOp *op)
 		break;
 	default:
 		if (!is_literal(t->type))
-			die("unexpected token type\n");
+			fail("unexpected token type\n");
+
+		if (quantiles && t->type == T_NUMBER &&
+				op->op.table->field + op->column == keyfield)
+			td_add(&digest, strtod(t->text, NULL), 1);
 
-		add_value(op->op.table, op->column, t->text);
+		add_value(op->op.table, op->column, t->text, t->type == T_STRING);
 		next_token();
 		break;
 	}
@@ -1028,11 +5053,15 @@ void accept(TokenType type)
 {
 	Token *t = next_token();
 	if (t->type != type)
-		die("unexpected token type\n");
+		fail("unexpected token type\n");
 }
 
 void skip_value()
 {
+	// skip without producing tokens when the source can
+	if (!lexer.peek && lexer.source->skip && lexer.source->skip(false))
+		return;
+
 	Token *t = peek_token();
 
 	switch (t->type) {
@@ -1044,7 +5073,7 @@ void skip_value()
 		break;
 	default:
 		if (!is_literal(t->type))
-			die("unexpected token type\n");
+			fail("unexpected token type\n");
 		next_token();
 		break;
 	}
@@ -1052,6 +5081,12 @@ void skip_value()
 
 void skip_array()
 {
+	if (lexer.peek && lexer.source->skip && lexer.peek->type == T_BEGINARRAY) {
+		lexer.peek = NULL;
+		lexer.source->skip(true);
+		return;
+	}
+
 	accept(T_BEGINARRAY);
 
 	Token *t = peek_token();
@@ -1066,12 +5101,18 @@ void skip_array()
 		} while (t->type == T_MEMBERSEP);
 
 		if (t->type != T_ENDARRAY)
-			die("expected array end\n");
+			fail("expected array end\n");
 	}
 }
 
 void skip_object()
 {
+	if (lexer.peek && lexer.source->skip && lexer.peek->type == T_BEGINOBJECT) {
+		lexer.peek = NULL;
+		lexer.source->skip(true);
+		return;
+	}
+
 	accept(T_BEGINOBJECT);
 	Token *t = peek_token();
 
@@ -1087,7 +5128,7 @@ void skip_object()
 		} while (t->type == T_MEMBERSEP);
 
 		if (t->type != T_ENDOBJECT)
-			die("expected object end\n");
+			fail("expected object end\n");
 	}
 }
 
@@ -1104,6 +5145,29 @@ bool is_literal(TokenType type)
 	}
 }
 
+void fail(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(lexer.error, sizeof(lexer.error), fmt, ap);
+	va_end(ap);
+
+	uint64_t off = lexer.buf.pos + lexer.buf.i;
+	fail_at(off > 0 ? off - 1 : 0);
+}
+
+void fail_at(uint64_t off)
+{
+	// report lexer.error at off
+	lexer.erroff = off;
+
+	if (lexer.recover)
+		longjmp(*lexer.recover, 1);
+
+	fputs(lexer.error, stderr);
+	exit(1);
+}
+
 void die(const char *fmt, ...)
 {
 	va_list ap;
@@ -1115,16 +5179,53 @@ void die(const char *fmt, ...)
 
 void *xcalloc(size_t nmemb, size_t size)
 {
-	void *ptr = calloc(nmemb, size);
-	if (!ptr)
+	if (size > 0 && nmemb > (SIZE_MAX - sizeof(MemHeader)) / size)
+		abort();
+
+	mem_charge(nmemb * size);
+
+	MemHeader *h = calloc(1, sizeof(*h) + nmemb * size);
+	if (!h)
 		abort();
-	return ptr;
+
+	h->size = nmemb * size;
+	return h + 1;
 }
 
 void *xrealloc(void *ptr, size_t size)
 {
-	ptr = realloc(ptr, size);
-	if (!ptr)
+	MemHeader *h = ptr ? (MemHeader*)ptr - 1 : NULL;
+	size_t old = h ? h->size : 0;
+
+	if (size > SIZE_MAX - sizeof(*h))
 		abort();
-	return ptr;
+
+	if (size > old)
+		mem_charge(size - old);
+	else
+		mem.used -= old - size;
+
+	h = realloc(h, sizeof(*h) + size);
+	if (!h)
+		abort();
+
+	h->size = size;
+	return h + 1;
+}
+
+void xfree(void *ptr)
+{
+	if (ptr) {
+		MemHeader *h = (MemHeader*)ptr - 1;
+		mem.used -= h->size;
+		free(h);
+	}
+}
+
+void mem_charge(size_t size)
+{
+	if (mem.max > 0 && size > mem.max - mem.used)
+		die("memory limit of %zu bytes exceeded\n", mem.max);
+
+	mem.used += size;
 }